@@ -0,0 +1,267 @@
+/******************************************************************************
+ * Project: mazerunner-core                                                   *
+ * File:    calibration.h                                                     *
+ * File Created: Saturday, 17th October 2026 10:12:40 am                      *
+ * Author: Peter Harrison                                                     *
+ * -----                                                                      *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
+ * -----                                                                      *
+ * Copyright 2022 - 2026 Peter Harrison, Micromouseonline                     *
+ * -----                                                                      *
+ * Licence:                                                                   *
+ *     Use of this source code is governed by an MIT-style                    *
+ *     license that can be found in the LICENSE file or at                    *
+ *     https://opensource.org/licenses/MIT.                                   *
+ ******************************************************************************/
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include "config.h"
+#include "src/sensors.h"
+#include "src/serial.h"
+#include "src/utils.h"
+#include <Arduino.h>
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+#include <EEPROM.h>
+#endif
+
+/***
+ * The wall sensor calibration values in the robot config file are picked at
+ * compile time by EVENT. Here, they are only the defaults. A calibration can
+ * be measured on the robot, given a name and kept in EEPROM so that each
+ * venue gets its own set without a rebuild.
+ *
+ * To calibrate, put the robot centred in a cell with walls on both sides and
+ * one ahead. Then send 'CAL name' from the CLI. The robot averages the raw
+ * readings for a moment. Each calibration value is then whatever makes the
+ * normalised reading match the one that the linearisation table expects at
+ * that distance. For the side sensors, that is just the raw reading. The
+ * front sensors are nearer the wall than their calibration position so the
+ * table is needed to scale them.
+ *
+ * Up to CALIBRATION_SETS named sets are stored along with the index of the
+ * active set. The active set is loaded at boot. 'USE name' makes another set
+ * active and 'K' lists them all.
+ */
+
+const uint8_t CALIBRATION_SETS = 4;
+const uint8_t CALIBRATION_NAME_LENGTH = 8; // including the terminating null
+const uint8_t CALIBRATION_SIGNATURE = 0xC5;
+const uint8_t CALIBRATION_NONE = 255;
+const int CALIBRATION_SAMPLES = 32;
+const int CALIBRATION_MIN_READING = 10; // anything less and there is no wall
+
+struct CalibrationSet {
+  char name[CALIBRATION_NAME_LENGTH];
+  int16_t front_left;
+  int16_t front_right;
+  int16_t left;
+  int16_t right;
+};
+
+class SensorCalibration;
+extern SensorCalibration calibration;
+
+class SensorCalibration {
+public:
+  /***
+   * @brief load the active set from EEPROM or use the defaults if there is none
+   */
+  void begin() {
+    use_defaults();
+    if (has_signature()) {
+      uint8_t index = read_active_index();
+      if (index < CALIBRATION_SETS) {
+        read_set(index, m_active);
+        m_index = index;
+      }
+    }
+    apply();
+  }
+
+  void use_defaults() {
+    strcpy(m_active.name, "DEFAULT");
+    m_active.front_left = FRONT_LEFT_CALIBRATION;
+    m_active.front_right = FRONT_RIGHT_CALIBRATION;
+    m_active.left = LEFT_CALIBRATION;
+    m_active.right = RIGHT_CALIBRATION;
+    m_index = CALIBRATION_NONE;
+  }
+
+  void apply() {
+    sensors.set_calibration(m_active.front_left, m_active.front_right, m_active.left, m_active.right);
+  }
+
+  /***
+   * Take the calibration readings with the robot centred in a cell.
+   * @return false if any of the walls could not be seen
+   */
+  bool measure(CalibrationSet &set) {
+    long front_left = 0;
+    long front_right = 0;
+    long left = 0;
+    long right = 0;
+    sensors.enable();
+    delay(100);
+    for (int i = 0; i < CALIBRATION_SAMPLES; i++) {
+      front_left += sensors.lfs.raw;
+      front_right += sensors.rfs.raw;
+      left += sensors.lss.raw;
+      right += sensors.rss.raw;
+      delay(2);
+    }
+    sensors.disable();
+    front_left /= CALIBRATION_SAMPLES;
+    front_right /= CALIBRATION_SAMPLES;
+    left /= CALIBRATION_SAMPLES;
+    right /= CALIBRATION_SAMPLES;
+    if (min(min(front_left, front_right), min(left, right)) < CALIBRATION_MIN_READING) {
+      return false;
+    }
+    set.front_left = front_left * FRONT_NOMINAL / Sensors::distance_to_value(LFS_TABLE, FRONT_REFERENCE_DISTANCE);
+    set.front_right = front_right * FRONT_NOMINAL / Sensors::distance_to_value(RFS_TABLE, FRONT_REFERENCE_DISTANCE);
+    set.left = left * SIDE_NOMINAL / Sensors::distance_to_value(LSS_TABLE, SIDE_REFERENCE_DISTANCE);
+    set.right = right * SIDE_NOMINAL / Sensors::distance_to_value(RSS_TABLE, SIDE_REFERENCE_DISTANCE);
+    return true;
+  }
+
+  /***
+   * Measure a new calibration, store it under the given name and make it the
+   * active set. A set with the same name gets replaced.
+   */
+  void calibrate(const char *name) {
+    CalibrationSet set;
+    if (not measure(set)) {
+      console.println(F("Calibration failed - no walls"));
+      return;
+    }
+    strncpy(set.name, name, CALIBRATION_NAME_LENGTH - 1);
+    set.name[CALIBRATION_NAME_LENGTH - 1] = 0;
+    if (not has_signature()) {
+      format();
+    }
+    uint8_t index = find(set.name);
+    if (index == CALIBRATION_NONE) {
+      index = find("");
+    }
+    m_active = set;
+    m_index = index;
+    apply();
+    if (index == CALIBRATION_NONE) {
+      console.println(F("No free slot - calibration not saved"));
+    } else {
+      write_set(index, set);
+      write_active_index(index);
+    }
+    print_set(m_active);
+  }
+
+  /***
+   * @return false if there is no set with that name
+   */
+  bool select(const char *name) {
+    uint8_t index = has_signature() ? find(name) : CALIBRATION_NONE;
+    if (index == CALIBRATION_NONE) {
+      return false;
+    }
+    read_set(index, m_active);
+    m_index = index;
+    write_active_index(index);
+    apply();
+    return true;
+  }
+
+  void print() {
+    console.print(F("active: "));
+    print_set(m_active);
+    if (not has_signature()) {
+      return;
+    }
+    for (uint8_t i = 0; i < CALIBRATION_SETS; i++) {
+      CalibrationSet set;
+      read_set(i, set);
+      if (set.name[0] == 0) {
+        continue;
+      }
+      console.print(i == m_index ? '*' : ' ');
+      print_justified(i, 2);
+      console.print(F(": "));
+      print_set(set);
+    }
+  }
+
+private:
+  void print_set(const CalibrationSet &set) {
+    console.print(set.name);
+    print_justified(set.front_left, 6);
+    print_justified(set.left, 6);
+    print_justified(set.right, 6);
+    print_justified(set.front_right, 6);
+    console.println();
+  }
+
+  uint8_t find(const char *name) {
+    for (uint8_t i = 0; i < CALIBRATION_SETS; i++) {
+      CalibrationSet set;
+      read_set(i, set);
+      if (strncmp(set.name, name, CALIBRATION_NAME_LENGTH) == 0) {
+        return i;
+      }
+    }
+    return CALIBRATION_NONE;
+  }
+
+  /***
+   * The EEPROM area starts with a signature and the index of the active set.
+   * The sets follow. Without the signature, nothing there can be trusted so
+   * all the slots are emptied before the first one is written.
+   */
+  int set_address(uint8_t index) {
+    return EEPROM_CALIBRATION + 2 + index * sizeof(CalibrationSet);
+  }
+
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+  bool has_signature() {
+    return EEPROM.read(EEPROM_CALIBRATION) == CALIBRATION_SIGNATURE;
+  }
+
+  void format() {
+    CalibrationSet empty = {{0}, 0, 0, 0, 0};
+    for (uint8_t i = 0; i < CALIBRATION_SETS; i++) {
+      write_set(i, empty);
+    }
+    write_active_index(CALIBRATION_NONE);
+    EEPROM.update(EEPROM_CALIBRATION, CALIBRATION_SIGNATURE);
+  }
+
+  uint8_t read_active_index() {
+    return EEPROM.read(EEPROM_CALIBRATION + 1);
+  }
+
+  void write_active_index(uint8_t index) {
+    EEPROM.update(EEPROM_CALIBRATION + 1, index);
+  }
+
+  void read_set(uint8_t index, CalibrationSet &set) {
+    EEPROM.get(set_address(index), set);
+  }
+
+  void write_set(uint8_t index, const CalibrationSet &set) {
+    EEPROM.put(set_address(index), set);
+  }
+#else
+  // without EEPROM only the active set is kept, and only until a reset
+  bool has_signature() { return false; }
+  void format() {}
+  uint8_t read_active_index() { return CALIBRATION_NONE; }
+  void write_active_index(uint8_t index) {}
+  void read_set(uint8_t index, CalibrationSet &set) { set.name[0] = 0; }
+  void write_set(uint8_t index, const CalibrationSet &set) {}
+#endif
+
+  CalibrationSet m_active;
+  uint8_t m_index = CALIBRATION_NONE;
+};
+
+#endif
@@ -17,13 +17,18 @@
 #ifndef CLI_H_
 #define CLI_H_
 
+#include "calibration.h"
 #include "config.h"
 #include "maze.h"
 #include "mouse.h"
 #include "reports.h"
+#include "src/profiler.h"
+#include "src/recorder.h"
 #include "src/sensors.h"
 #include "src/serial.h"
+#include "src/telemetry.h"
 #include "src/utils.h"
+#include "turn_triggers.h"
 #include <Arduino.h>
 #include <stdint.h>
 
@@ -178,6 +183,24 @@ public:
    *
    */
   void run_long_cmd(const Args args) {
+    if (strcmp(args.argv[0], "CAL") == 0) {
+      calibration.calibrate(args.argv[1]);
+      return;
+    }
+    if (strcmp(args.argv[0], "USE") == 0) {
+      if (not calibration.select(args.argv[1])) {
+        console.println(F("No such calibration"));
+      }
+      return;
+    }
+    if (strcmp(args.argv[0], "TEL") == 0) {
+      telemetry_cmd(args);
+      return;
+    }
+    if (strcmp(args.argv[0], "TRIG") == 0) {
+      trigger_cmd(args);
+      return;
+    }
     int function = -1;
     int digits = read_integer(args.argv[1], function);
     if (digits > 0) {
@@ -185,6 +208,125 @@ public:
     }
   }
 
+  /***
+   * Choose the telemetry channels and how often each one is sent.
+   *
+   *   TEL ?        - list the channels and their decimation
+   *   TEL name n   - send the channel every n control ticks. 0 turns it off
+   *   TEL OFF      - turn off every channel
+   *   TEL DEFAULT  - go back to the default channels
+   *
+   * A command always has at least two tokens or it would be taken for a
+   * single-character command.
+   */
+  void telemetry_cmd(const Args &args) {
+#if !TELEMETRY
+    (void)args;
+    console.println(F("Set TELEMETRY in config.h to use binary telemetry"));
+#else
+    if (strcmp(args.argv[1], "?") == 0) {
+      telemetry.print_channels();
+      return;
+    }
+    if (strcmp(args.argv[1], "OFF") == 0) {
+      telemetry.unsubscribe_all();
+      return;
+    }
+    if (strcmp(args.argv[1], "DEFAULT") == 0) {
+      telemetry.set_defaults();
+      return;
+    }
+    // the names are lower case but the input has been converted to upper case
+    char name[16];
+    strncpy(name, args.argv[1], sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    for (char *p = name; *p; p++) {
+      *p = tolower(*p);
+    }
+    int channel = telemetry.find_channel(name);
+    int decimation = 0;
+    if (channel < 0 || args.argc < 3 || read_integer(args.argv[2], decimation) == 0) {
+      console.println(F("Use TEL name n. TEL ? lists the names"));
+      return;
+    }
+    telemetry.subscribe(channel, constrain(decimation, 0, 255));
+#endif
+  }
+
+  /***
+   * Set up the flight recorder trigger for the next run.
+   *
+   *   TRIG ?                 - show the trigger
+   *   TRIG OFF               - no trigger. Just keep the last samples
+   *   TRIG LFS n [post]      - a wall sensor at or above n. Also LSS, RSS, RFS
+   *   TRIG FWD_ERR x [post]  - a forward error of x mm or more
+   *   TRIG ROT_ERR x [post]  - a rotation error of x degrees or more
+   *   TRIG TURN [post]       - a search turn starting
+   *   TRIG WALL [post]       - a stop against the wall ahead
+   *   TRIG RATE n            - take a sample every n control ticks
+   *
+   * post is the number of samples to keep after the trigger. If it is left
+   * out, the trigger goes in the middle of the buffer. The error levels are
+   * limited to 327.67, the most that a sample can hold.
+   */
+  void trigger_cmd(const Args &args) {
+    const char *what = args.argv[1];
+    int post = RECORDER_SAMPLES / 2;
+    if (strcmp(what, "?") == 0) {
+      reporter.show_recorder_trigger();
+      return;
+    }
+    if (strcmp(what, "OFF") == 0) {
+      recorder.set_trigger(TRIGGER_OFF, 0, 0);
+      return;
+    }
+    if (strcmp(what, "RATE") == 0) {
+      int rate = 0;
+      if (args.argc > 2 && read_integer(args.argv[2], rate) > 0) {
+        recorder.set_decimation(constrain(rate, 1, 255));
+      }
+      reporter.show_recorder_trigger();
+      return;
+    }
+    if (strcmp(what, "TURN") == 0 || strcmp(what, "WALL") == 0) {
+      if (args.argc > 2) {
+        read_integer(args.argv[2], post);
+      }
+      char event = what[0] == 'T' ? EVENT_TURN_START : EVENT_WALL_STOP;
+      recorder.set_trigger(TRIGGER_EVENT, event, max(post, 0));
+      reporter.show_recorder_trigger();
+      return;
+    }
+    TriggerSource source = TRIGGER_OFF;
+    float scale = 1.0f;
+    if (strcmp(what, "LFS") == 0) {
+      source = TRIGGER_LFS;
+    } else if (strcmp(what, "LSS") == 0) {
+      source = TRIGGER_LSS;
+    } else if (strcmp(what, "RSS") == 0) {
+      source = TRIGGER_RSS;
+    } else if (strcmp(what, "RFS") == 0) {
+      source = TRIGGER_RFS;
+    } else if (strcmp(what, "FWD_ERR") == 0) {
+      source = TRIGGER_FWD_ERROR;
+      scale = 100.0f;
+    } else if (strcmp(what, "ROT_ERR") == 0) {
+      source = TRIGGER_ROT_ERROR;
+      scale = 100.0f;
+    }
+    float level = 0;
+    if (source == TRIGGER_OFF || args.argc < 3 || read_float(args.argv[2], level) == 0) {
+      console.println(F("Use TRIG source level [post]. See the help"));
+      return;
+    }
+    if (args.argc > 3) {
+      read_integer(args.argv[3], post);
+    }
+    // the level is an int. A larger value would wrap negative and fire at once
+    recorder.set_trigger(source, lroundf(constrain(level * scale, 0.0f, 32767.0f)), max(post, 0));
+    reporter.show_recorder_trigger();
+  }
+
   /***
    * Simple commands represented by a single character
    *
@@ -223,6 +365,43 @@ public:
         reporter.show_wall_sensors();
         sensors.disable();
         break;
+      case 'L':
+        turn_triggers.print();
+        break;
+      case 'Z':
+        console.println(F("Reset turn triggers"));
+        turn_triggers.reset();
+        turn_triggers.save();
+        break;
+      case 'K':
+        calibration.print();
+        break;
+      case 'I':
+        reporter.show_systick_timing();
+        break;
+      case 'T':
+#if TELEMETRY
+        reporter.set_binary_mode(not reporter.binary_mode());
+        console.print(F("Binary telemetry "));
+        console.println(reporter.binary_mode() ? F("ON") : F("OFF"));
+#else
+        console.println(F("Set TELEMETRY in config.h to use binary telemetry"));
+#endif
+        break;
+      case 'D':
+        reporter.show_flight_record();
+        break;
+      case 'M':
+        reporter.show_memory();
+        break;
+      case 'P':
+#if PROFILING
+        profiler.print();
+        profiler.reset();
+#else
+        console.println(F("Set PROFILING in src/profiler.h to use the profiler"));
+#endif
+        break;
       default:
         break;
     }
@@ -250,6 +429,23 @@ public:
     console.println(F("R   : display maze with directions"));
     console.println(F("B   : show battery voltage"));
     console.println(F("S   : show sensor readings"));
+    console.println(F("L   : show learned turn triggers"));
+    console.println(F("Z   : reset learned turn triggers"));
+    console.println(F("K   : list sensor calibrations"));
+    console.println(F("I   : show systick ISR timing"));
+    console.println(F("M   : show RAM and stack use"));
+    console.println(F("D   : dump the flight recorder"));
+    console.println(F("TRIG ?   : show the flight recorder trigger"));
+    console.println(F("TRIG src level [post] : trigger on LFS LSS RSS RFS FWD_ERR ROT_ERR"));
+    console.println(F("TRIG TURN|WALL [post] : trigger on a turn or a wall stop"));
+    console.println(F("TRIG RATE n : flight recorder sample every n ticks"));
+    console.println(F("TRIG OFF : no trigger"));
+    console.println(F("T   : toggle binary telemetry for reports"));
+    console.println(F("P   : show section profile"));
+    console.println(F("CAL name : calibrate sensors, robot centred in a cell"));
+    console.println(F("USE name : use a stored sensor calibration"));
+    console.println(F("TEL ?    : list the telemetry channels"));
+    console.println(F("TEL name n : send a telemetry channel every n ticks"));
     console.println(F("F n : Run user function n"));
     console.println(F("       0 = ---"));
     console.println(F("       1 = Sensor Calibration"));
@@ -258,8 +454,8 @@ public:
     console.println(F("       4 = "));
     console.println(F("       5 = "));
     console.println(F("       6 = "));
-    console.println(F("       7 = "));
-    console.println(F("       8 = "));
+    console.println(F("       7 = Motor characterisation"));
+    console.println(F("       8 = Front sensor table sweep"));
     console.println(F("       9 = "));
     console.println(F("      10 = "));
     console.println(F("      11 = "));
@@ -54,8 +54,45 @@ const float FWD_KD = 1.1;
 const float ROT_KP = 2.1;
 const float ROT_KD = 1.2;
 
+/***
+ * Gain scheduling. A single set of gains has to work from slow calibration
+ * moves to full speed runs. Instead, the gains are interpolated from these
+ * tables according to the current profile speed. Entry i is for a speed of
+ * i * FWD_GAIN_SPEED_STEP mm/s or i * ROT_GAIN_SPEED_STEP deg/s. Above the
+ * last entry, the last value is used. Direction does not matter.
+ * Make all the entries the same for fixed gains.
+ */
+const int GAIN_TABLE_SIZE = 4;
+const float FWD_GAIN_SPEED_STEP = 500.0; // mm/s
+const float FWD_KP_TABLE[GAIN_TABLE_SIZE] PROGMEM = {FWD_KP, FWD_KP, FWD_KP, FWD_KP};
+const float FWD_KD_TABLE[GAIN_TABLE_SIZE] PROGMEM = {FWD_KD, FWD_KD, FWD_KD, FWD_KD};
+const float ROT_GAIN_SPEED_STEP = 250.0; // deg/s
+const float ROT_KP_TABLE[GAIN_TABLE_SIZE] PROGMEM = {ROT_KP, ROT_KP, ROT_KP, ROT_KP};
+const float ROT_KD_TABLE[GAIN_TABLE_SIZE] PROGMEM = {ROT_KD, ROT_KD, ROT_KD, ROT_KD};
+
+/***
+ * Controller structure. Normally the forward and rotation controllers are
+ * PD controllers acting on the accumulated position error, as above.
+ * Set CASCADED_CONTROL true to use a cascaded structure instead. An outer
+ * loop turns the position error into a velocity correction. An inner PI
+ * loop, running at the same rate, closes on the encoder velocity. The
+ * encoder velocity is coarse so it is low-pass filtered by VELOCITY_FILTER.
+ * The gain tables above are not used by the cascaded controllers.
+ */
+const bool CASCADED_CONTROL = false;
+const float VELOCITY_FILTER = 0.5;
+const float FWD_POS_KP = 5.0;    // (mm/s) per mm
+const float FWD_VEL_KP = 0.0022; // volts per mm/s
+const float FWD_VEL_KI = 2.0;    // volts per mm
+const float ROT_POS_KP = 5.0;    // (deg/s) per deg
+const float ROT_VEL_KP = 0.0024; // volts per deg/s
+const float ROT_VEL_KI = 2.1;    // volts per deg
+// the integral term alone never asks for more than MAX_MOTOR_VOLTS. No integral if KI is zero
+const float FWD_INTEGRAL_LIMIT = FWD_VEL_KI > 0 ? MAX_MOTOR_VOLTS / FWD_VEL_KI : 0; // mm
+const float ROT_INTEGRAL_LIMIT = ROT_VEL_KI > 0 ? MAX_MOTOR_VOLTS / ROT_VEL_KI : 0; // deg
+
 // controller constants for the steering controller
-const float STEERING_KP = 0.25;
+const float STEERING_KP = 0.6; // per mm of cross-track error
 const float STEERING_KD = 0.00;
 const float STEERING_ADJUST_LIMIT = 10.0; // deg/s
 
@@ -79,6 +116,31 @@ const float ACC_FF = 0.000392;
 const float SPEED_FF = 0.00357;
 const float BIAS_FF = 0.121;
 
+/***
+ * Real motors are not linear and there is some difference between the left and
+ * right drive trains. For better feedforward, each wheel gets a table of the
+ * voltage needed to keep it turning at a steady speed. Entry i is for a speed
+ * of i * FF_SPEED_STEP mm/s and does not include the bias. Between entries the
+ * voltage is interpolated. Above the last entry it is extrapolated.
+ * The bias is only applied when the wheel is meant to be moving, with the same
+ * sign as the wheel speed.
+ * Until the robot has been characterised, the tables just repeat the linear
+ * model above. The motor characterisation (function 7) prints out tables that
+ * can be pasted in here.
+ */
+const int FF_TABLE_SIZE = 9;
+const float FF_SPEED_STEP = 200.0; // mm/s between table entries
+const float LEFT_BIAS_FF = BIAS_FF;
+const float RIGHT_BIAS_FF = BIAS_FF;
+const float LEFT_FF_TABLE[FF_TABLE_SIZE] PROGMEM = {
+    0 * FF_SPEED_STEP * SPEED_FF, 1 * FF_SPEED_STEP * SPEED_FF, 2 * FF_SPEED_STEP * SPEED_FF,
+    3 * FF_SPEED_STEP * SPEED_FF, 4 * FF_SPEED_STEP * SPEED_FF, 5 * FF_SPEED_STEP * SPEED_FF,
+    6 * FF_SPEED_STEP * SPEED_FF, 7 * FF_SPEED_STEP * SPEED_FF, 8 * FF_SPEED_STEP * SPEED_FF};
+const float RIGHT_FF_TABLE[FF_TABLE_SIZE] PROGMEM = {
+    0 * FF_SPEED_STEP * SPEED_FF, 1 * FF_SPEED_STEP * SPEED_FF, 2 * FF_SPEED_STEP * SPEED_FF,
+    3 * FF_SPEED_STEP * SPEED_FF, 4 * FF_SPEED_STEP * SPEED_FF, 5 * FF_SPEED_STEP * SPEED_FF,
+    6 * FF_SPEED_STEP * SPEED_FF, 7 * FF_SPEED_STEP * SPEED_FF, 8 * FF_SPEED_STEP * SPEED_FF};
+
 // encoder polarity is either 1 or -1 and is used to account for reversal of the encoder phases
 #define ENCODER_LEFT_POLARITY (-1)
 #define ENCODER_RIGHT_POLARITY (1)
@@ -98,6 +160,30 @@ const int SEARCH_TURN_SPEED = 300;
 const int OMEGA_SPIN_TURN = 360;
 const int ALPHA_SPIN_TURN = 3600;
 
+/***
+ * Acceleration supervisor. Wheel slip shows up as a controller error that
+ * keeps growing. If the motor voltage is at its limit, the robot cannot
+ * accelerate as fast as asked. In either case the supervisor in systick
+ * reduces the acceleration of the affected profile for a while.
+ * Each tick with a problem multiplies the scale by ACC_SCALE_DECAY, down to
+ * ACC_SCALE_MIN. Without a problem, the scale recovers at ACC_SCALE_RECOVERY
+ * per second back to 1.0. Braking is never limited so stopping distances
+ * are not affected.
+ */
+const float SLIP_FWD_ERROR = 8.0;       // mm
+const float SLIP_ROT_ERROR = 6.0;       // deg
+const float SATURATION_MARGIN = 0.95;   // fraction of the available motor volts
+const float ACC_SCALE_MIN = 0.4;        // fraction of the profile acceleration
+const float ACC_SCALE_DECAY = 0.98;     // per tick
+const float ACC_SCALE_RECOVERY = 0.5;   // per second
+
+/***
+ * A controller error bigger than this means the robot has hit something or
+ * lost traction altogether. It freezes the flight recorder.
+ */
+const float CRASH_FWD_ERROR = 30.0;     // mm
+const float CRASH_ROT_ERROR = 25.0;     // deg
+
 //***************************************************************************//
 
 //***** SENSOR CALIBRATION **************************************************//
@@ -106,6 +192,8 @@ const float SENSING_POSITION = 170.0;
 
 // wall sensor thresholds and constants
 // if you have the basic sensor board enter the same value for both front constants
+// These are the defaults. Calibrations measured on the robot are kept in
+// EEPROM and replace them at boot. See calibration.h.
 #if EVENT == EVENT_HOME
 // RAW values for the front sensor when the robot is backed up to a wall
 // with another wall ahead
@@ -166,11 +254,41 @@ const float FRONT_RIGHT_SCALE = (float)FRONT_NOMINAL / FRONT_RIGHT_CALIBRATION;
 const float LEFT_SCALE = (float)SIDE_NOMINAL / LEFT_CALIBRATION;
 const float RIGHT_SCALE = (float)SIDE_NOMINAL / RIGHT_CALIBRATION;
 
-// the values above which, a wall is seen
-const int LEFT_THRESHOLD = 40;   // minimum value to register a wall
-const int FRONT_THRESHOLD = 20;  // minimum value to register a wall
-const int RIGHT_THRESHOLD = 40;  // minimum value to register a wall
-const int FRONT_REFERENCE = 850; // reading when mouse centered with wall ahead
+//***** SENSOR LINEARISATION ************************************************//
+/***
+ * The normalised values are proportional to the raw readings but reflected
+ * light falls off roughly as the square of the distance to the wall. These
+ * tables turn a normalised reading into the distance, in mm, from the robot
+ * centre to the wall. Entry i is the normalised reading with the wall at
+ * SENSOR_TABLE_START + i * SENSOR_TABLE_STEP. Values must not increase along
+ * the table. With the basic sensor board, use the same front table twice.
+ *
+ * The front tables should come from a calibration sweep. Run user function 8
+ * and paste in the tables that it prints. The robot cannot drive sideways so
+ * there is no sweep for the side tables.
+ *
+ * Because the tables use normalised readings, they do not need to change
+ * when the sensors are recalibrated for a new maze. See calibration.h.
+ *
+ * The values here are modelled with an inverse square law. The nominal front
+ * reading is at 120mm, backed up to a wall, and the nominal side reading is
+ * at 84mm, centred in a cell.
+ */
+const int SENSOR_TABLE_SIZE = 16;
+const int SENSOR_TABLE_START = 50; // mm
+const int SENSOR_TABLE_STEP = 15;  // mm
+const int LFS_TABLE[SENSOR_TABLE_SIZE] PROGMEM = {576, 341, 225, 160, 119, 92, 73, 60, 50, 42, 36, 31, 27, 24, 21, 19};
+const int LSS_TABLE[SENSOR_TABLE_SIZE] PROGMEM = {282, 167, 110, 78, 58, 45, 36, 29, 24, 21, 18, 15, 13, 12, 10, 9};
+const int RSS_TABLE[SENSOR_TABLE_SIZE] PROGMEM = {282, 167, 110, 78, 58, 45, 36, 29, 24, 21, 18, 15, 13, 12, 10, 9};
+const int RFS_TABLE[SENSOR_TABLE_SIZE] PROGMEM = {576, 341, 225, 160, 119, 92, 73, 60, 50, 42, 36, 31, 27, 24, 21, 19};
+
+// distances from the robot centre, in mm, below which a wall is seen
+const int LEFT_WALL_DISTANCE = 130;
+const int FRONT_WALL_DISTANCE = 270;
+const int RIGHT_WALL_DISTANCE = 130;
+// distance from the robot centre to the walls when it is centred in a cell
+const int SIDE_REFERENCE_DISTANCE = 84;
+const int FRONT_REFERENCE_DISTANCE = 84;
 
 const float left_edge_pos = 90.0f;
 const float right_edge_pos = 93.0f;
@@ -184,6 +302,16 @@ const TurnParameters turn_params[4] = {
     {SEARCH_TURN_SPEED, 20, 10, -90, 280, 4000, TURN_THRESHOLD_SS90E}, // 0 => SS90R
 };
 
+// The turn trigger threshold is raised when there are walls to the side. These
+// are only the starting values. The robot learns better adjustments for each
+// turn and wall combination as it runs. See turn_triggers.h
+const int TRIGGER_LEFT_WALL_ADJUST = 10;
+const int TRIGGER_RIGHT_WALL_ADJUST = 6;
+// how much the front sensor sum changes per mm close to the turn trigger point
+const float TRIGGER_COUNTS_PER_MM = 2.0;
+// each turn moves the learned adjustment 1/(2^TRIGGER_LEARNING_SHIFT) of the way
+const int TRIGGER_LEARNING_SHIFT = 2;
+
 //***************************************************************************//
 //***************************************************************************//
 // Some physical constants that are likely to be board -specific
@@ -264,4 +392,14 @@ const int LED_USER_B = USER_IO_6;
 const int EMITTER_FRONT = USER_IO_11;
 const int EMITTER_DIAGONAL = USER_IO_12;
 
+// Oversampling for the wall sensors. Each reading is the sum of
+// 2^SENSOR_OVERSAMPLE_SHIFT conversions, up to 64, shifted right by
+// SENSOR_RESULT_SHIFT. Making the two the same keeps the readings in the
+// 10 bit range so none of the thresholds need to change. Set both to zero
+// for a single conversion. The NANO EVERY adds up the samples in hardware.
+// The NANO has to perform every conversion in the ISR so its sensor cycle
+// gets longer. A shift of 2 takes it to about 1ms with the default ADC clock.
+const uint8_t SENSOR_OVERSAMPLE_SHIFT = 2;
+const uint8_t SENSOR_RESULT_SHIFT = 2;
+
 #endif
\ No newline at end of file
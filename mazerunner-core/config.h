@@ -164,14 +164,148 @@ struct TurnParameters {
  * RAM storage is used. Constants are used for better type checking and traceability.
  */
 
-const float LOOP_FREQUENCY = 500.0f;
+/***
+ * SYSTICK_HZ is the systick rate and can be 500, 1000 or 2000. Everything
+ * that depends on the tick rate is worked out from it. That includes the
+ * timer setup in src/systick.h, the task rates below and the ADC clock.
+ */
+const int SYSTICK_HZ = 500;
+static_assert(SYSTICK_HZ == 500 || SYSTICK_HZ == 1000 || SYSTICK_HZ == 2000, "SYSTICK_HZ must be 500, 1000 or 2000");
+
+const float SYSTICK_FREQUENCY = SYSTICK_HZ;
+const float SYSTICK_INTERVAL = (1.0f / SYSTICK_FREQUENCY);
+
+/***
+ * Not everything in systick needs to run on every tick. Each task runs once
+ * every so many systick ticks. See src/systick.h for the schedule.
+ *
+ *   CONTROL - encoders, profiles and motor controllers
+ *   SENSOR  - wall sensors and steering. Also starts the next ADC cycle
+ *   BATTERY - battery voltage and the motor compensation
+ *   SWITCH  - the function switches and button
+ *
+ * LOOP_FREQUENCY and LOOP_INTERVAL belong to the control task. They are
+ * what the profiles and controllers use for their sums.
+ *
+ * The sensor cycle cannot keep up with more than 1kHz so the sensors run
+ * every other tick at 2kHz. The battery is checked at 50Hz and the switches
+ * at 25Hz whatever the tick rate.
+ */
+const uint8_t CONTROL_TICKS = 1;
+const uint8_t SENSOR_TICKS = SYSTICK_HZ > 1000 ? SYSTICK_HZ / 1000 : 1;
+const uint8_t BATTERY_TICKS = SYSTICK_HZ / 50;
+const uint8_t SWITCH_TICKS = SYSTICK_HZ / 25;
+
+const float LOOP_FREQUENCY = SYSTICK_FREQUENCY / CONTROL_TICKS;
 const float LOOP_INTERVAL = (1.0f / LOOP_FREQUENCY);
+const float SENSOR_FREQUENCY = SYSTICK_FREQUENCY / SENSOR_TICKS;
+
+/***
+ * The ADC clock is normally F_CPU/32. That gets the whole sensor cycle done
+ * in about 1ms. A 1ms sensor period needs the faster F_CPU/16 clock. The
+ * results are a little noisier.
+ */
+const uint8_t ADC_CLOCK_DIVIDER = SENSOR_FREQUENCY > 500 ? 16 : 32;
+
+/***
+ * Some of the constants in the robot config work per control tick and were
+ * tuned with a 500Hz loop. These are the same constants adjusted for the
+ * actual loop rate so the response in real time does not change. At 500Hz
+ * they are just the originals. The compiler does the sums.
+ *
+ * The PD controller D gains act on the change in error over one tick. That
+ * change gets smaller as the loop runs faster so the gain must grow.
+ */
+const float TUNED_LOOP_FREQUENCY = 500.0f;
+const float DERIVATIVE_SCALE = LOOP_FREQUENCY / TUNED_LOOP_FREQUENCY;
+const float LOOP_VELOCITY_FILTER = 1.0f - powf(1.0f - VELOCITY_FILTER, TUNED_LOOP_FREQUENCY / LOOP_FREQUENCY);
+const float LOOP_ACC_SCALE_DECAY = powf(ACC_SCALE_DECAY, TUNED_LOOP_FREQUENCY / LOOP_FREQUENCY);
+
+/***
+ * The full scale motor PWM value. On the ATmega328, the motor driver writes
+ * directly to Timer 1 which is set up for 10 bit PWM. Everywhere else it
+ * is 8 bits, the same as analogWrite().
+ */
+#if defined(ARDUINO_ARCH_AVR)
+const int MOTOR_MAX_PWM = 1023;
+#else
+const int MOTOR_MAX_PWM = 255;
+#endif
+
+/***
+ * The battery reading is low-pass filtered each time the battery task runs.
+ * The filter time constant is (1 << BATTERY_FILTER_SHIFT) * BATTERY_TICKS
+ * systick ticks.
+ */
+const int BATTERY_FILTER_SHIFT = 2;
+
+/***
+ * Systick sends the console output from its transmit ring. Each tick it
+ * passes on a little more than the port can send in one tick. That keeps
+ * up with the baud rate without spending long in the interrupt.
+ */
+const int CONSOLE_TX_PER_TICK = min(255, (int)(BAUDRATE / 10 / SYSTICK_HZ) + 2);
+
+// a systick that starts later than this after its timer tick is counted as late
+const int SYSTICK_LATE_US = 100;
+
+// warn at the end of a run if the stack came closer than this to the heap
+const int STACK_MARGIN_WARNING = 64;
+
+/***
+ * The binary telemetry stream needs about 300 bytes of RAM for its buffers
+ * whether it is used or not. There is not enough to spare on the ATmega328
+ * so it is left out there by default. Set TELEMETRY to 1 to build it in.
+ * You will probably need to make RECORDER_SAMPLES smaller to make room.
+ */
+#if defined(ARDUINO_ARCH_AVR)
+#define TELEMETRY 0
+#else
+#define TELEMETRY 1
+#endif
+
+/***
+ * The flight recorder holds RECORDER_SAMPLES samples of 16 bytes each. By
+ * default it takes one every RECORDER_DECIMATION control ticks. The CLI
+ * can change that for a longer window. The buffer is in the
+ * .noinit section. The 'M' report counts it in the static total and lists
+ * it as 'recorder (noinit)'. On the ATmega328 there is very
+ * little to spare. Use the 'M' command to check the stack margin after a
+ * run if you make it bigger.
+ */
+#if defined(ARDUINO_ARCH_MEGAAVR)
+const int RECORDER_SAMPLES = 128;
+#elif defined(ARDUINO_ARCH_AVR)
+const int RECORDER_SAMPLES = 24;
+#else
+const int RECORDER_SAMPLES = 512;
+#endif
+const int RECORDER_DECIMATION = 1;
+static_assert(RECORDER_SAMPLES > 0, "the flight recorder needs at least one sample");
+static_assert(RECORDER_DECIMATION >= 1 && RECORDER_DECIMATION <= 255, "RECORDER_DECIMATION must fit in a byte");
+
+/***
+ * The wall sensor processing in systick uses only integer arithmetic. The
+ * sensor scale factors are fixed-point with SENSOR_SCALE_SHIFT fractional
+ * bits. The steering adjustment, in degrees per control tick, has STEERING_SHIFT
+ * fractional bits. The steering gains are pre-multiplied by LOOP_INTERVAL
+ * and rounded here so the compiler does all the work. Like the motor
+ * controllers, the D gain was tuned at 500Hz and acts on the change in error
+ * since the last sensor update so it is scaled by the sensor rate.
+ */
+const int SENSOR_SCALE_SHIFT = 10;
+const int STEERING_SHIFT = 20;
+const long STEERING_KP_FIXED = (long)(STEERING_KP * LOOP_INTERVAL * (1L << STEERING_SHIFT) + 0.5f);
+const long STEERING_KD_FIXED =
+    (long)(STEERING_KD * (SENSOR_FREQUENCY / TUNED_LOOP_FREQUENCY) * LOOP_INTERVAL * (1L << STEERING_SHIFT) + 0.5f);
+const long STEERING_LIMIT_FIXED = (long)(STEERING_ADJUST_LIMIT * (1L << STEERING_SHIFT));
 
 //***************************************************************************//
 
 // This is the size fo each cell in the maze. Normally 180mm for a classic maze
 const float FULL_CELL = 180.0f;
 const float HALF_CELL = FULL_CELL / 2.0f;
+const float WALL_THICKNESS = 12.0f;
 
 //***************************************************************************//
 /***
@@ -202,4 +336,13 @@ const float DEG_PER_MM_DIFFERENCE = (180.0 / (2 * MOUSE_RADIUS * PI));
  */
 #define PERSISTENT __attribute__((section(".noinit")))
 
+//***************************************************************************//
+/***
+ * Some things are worth keeping even after the power is turned off. This is
+ * where they live in the EEPROM. Each block starts with its own signature
+ * byte so that stale or missing data can be detected.
+ */
+const int EEPROM_TURN_TRIGGERS = 0; // 33 bytes
+const int EEPROM_CALIBRATION = 64;  // 66 bytes
+
 #endif
@@ -17,6 +17,7 @@
 #ifndef MAZE_H
 #define MAZE_H
 
+#include "src/profiler.h"
 #include "src/queue.h"
 #include "src/serial.h"
 #include "src/utils.h"
@@ -251,6 +252,7 @@ public:
    * @param target - the cell from which all distances are calculated
    */
   void flood_maze(uint8_t target) {
+    PROFILE_SECTION(PROF_FLOOD);
     for (int i = 0; i < 256; i++) {
       m_cost[i] = MAX_COST;
     }
@@ -14,6 +14,7 @@
  *     https://opensource.org/licenses/MIT.                                   *
  ******************************************************************************/
 
+#include "calibration.h"
 #include "cli.h"
 #include "config.h"
 #include "maze.h"
@@ -22,12 +23,17 @@
 #include "src/adc.h"
 #include "src/encoders.h"
 #include "src/list.h"
+#include "src/memory.h"
 #include "src/motion.h"
 #include "src/motors.h"
+#include "src/profiler.h"
+#include "src/recorder.h"
 #include "src/sensors.h"
 #include "src/serial.h"
 #include "src/switches.h"
 #include "src/systick.h"
+#include "src/telemetry.h"
+#include "turn_triggers.h"
 #include <Arduino.h>
 
 // Global objects
@@ -44,8 +50,20 @@ Maze maze PERSISTENT;
 Mouse mouse;
 CommandLineInterface cli;
 Reporter reporter;
+TurnTriggers turn_triggers;
+SensorCalibration calibration;
+#if PROFILING
+Profiler profiler;
+#endif
+MemoryMonitor memory;
+#if TELEMETRY
+Telemetry telemetry;
+#endif
+FlightRecorder recorder PERSISTENT;
 
 void setup() {
+  // before anything else has used the stack
+  memory.paint_stack();
 
   console.begin(BAUDRATE);
 
@@ -60,6 +78,16 @@ void setup() {
   adc.add_channel_to_group(1, 1);
   adc.add_channel_to_group(2, 1);
   adc.set_emitter_for_group(EMITTER_DIAGONAL, 1);
+  // these are only ever read dark
+  adc.add_channel(SWITCHES_CHANNEL);
+  adc.add_channel(BATTERY_CHANNEL);
+  // average out some of the noise on the wall sensors
+  adc.set_oversampling(RFS_CHANNEL, SENSOR_OVERSAMPLE_SHIFT, SENSOR_RESULT_SHIFT);
+  adc.set_oversampling(RSS_CHANNEL, SENSOR_OVERSAMPLE_SHIFT, SENSOR_RESULT_SHIFT);
+  adc.set_oversampling(LSS_CHANNEL, SENSOR_OVERSAMPLE_SHIFT, SENSOR_RESULT_SHIFT);
+  adc.set_oversampling(LFS_CHANNEL, SENSOR_OVERSAMPLE_SHIFT, SENSOR_RESULT_SHIFT);
+  // the sensor cycle must fit in the sensor period
+  adc.set_clock_divider(ADC_CLOCK_DIVIDER);
   // now configure the hardware
   adc.begin();
   pinMode(LED_USER, OUTPUT);
@@ -67,7 +95,13 @@ void setup() {
   pinMode(LED_BUILTIN, OUTPUT);
   motors.setup();
   encoders.setup();
+  // before systick can write to it
+  recorder.begin();
   systick.begin();
+  // systick sends the console output from now on
+  console.start_tx_ring();
+  turn_triggers.begin();
+  calibration.begin();
 
   if (switches.button_pressed()) {
     maze.initialise_maze();
@@ -86,6 +120,10 @@ void setup() {
 }
 
 void loop() {
+  systick.count_loop_pass();
+#if TELEMETRY
+  telemetry.send();
+#endif
   if (cli.read_serial() > 0) {
     cli.interpret_line();
   }
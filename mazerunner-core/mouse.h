@@ -24,10 +24,13 @@
 #include "src/motion.h"
 #include "src/motors.h"
 #include "src/profile.h"
+#include "src/recorder.h"
 #include "src/sensors.h"
 #include "src/serial.h"
 #include "src/switches.h"
+#include "src/systick.h"
 #include "src/utils.h"
+#include "turn_triggers.h"
 
 class Mouse;
 extern Mouse mouse;
@@ -70,6 +73,7 @@ public:
       return;
     }
     sensors.wait_for_user_start(); // cover front sensor with hand to start
+    recorder.arm();
     switch (cmd) {
       case 1:
         show_sensor_calibration();
@@ -89,12 +93,22 @@ public:
       case 6:
         test_sensor_spin_calibrate();
         break;
+      case 7:
+        test_motor_characterisation();
+        break;
+      case 8:
+        calibrate_front_sensor_tables();
+        break;
       default:
         // just to be safe...
         sensors.disable();
         motion.reset_drive_system();
         break;
     }
+    recorder.freeze(FREEZE_RUN_END);
+    reporter.end_reports();
+    reporter.show_stack_use();
+    reporter.show_console_drops();
   }
 
   /**
@@ -121,13 +135,13 @@ public:
     sensors.set_steering_mode(STEERING_OFF);
     forward.start(remaining, forward.speed(), 0, forward.acceleration());
     while (not forward.is_finished()) {
-      if (sensors.get_front_sum() > (FRONT_REFERENCE - 150)) {
+      if (sensors.get_front_distance() < (FRONT_REFERENCE_DISTANCE + 20)) {
         break;
       }
       delay(2);
     }
     if (sensors.see_front_wall) {
-      while (sensors.get_front_sum() < FRONT_REFERENCE) {
+      while (sensors.get_front_distance() > FRONT_REFERENCE_DISTANCE) {
         forward.start(10, 50, 0, 1000);
         delay(2);
       }
@@ -175,13 +189,10 @@ public:
     forward.set_target_speed(SEARCH_TURN_SPEED);
     TurnParameters params = turn_params[turn_id];
 
-    float trigger = params.trigger;
-    if (sensors.see_left_wall) {
-      trigger += 10; // MAGIC number
-    }
-    if (sensors.see_right_wall) {
-      trigger += 6; // MAGIC number
-    }
+    bool left_wall = sensors.see_left_wall;
+    bool right_wall = sensors.see_right_wall;
+    bool front_wall = sensors.see_front_wall;
+    float trigger = params.trigger + turn_triggers.offset(turn_id, left_wall, right_wall);
 
     float turn_point = FULL_CELL + params.run_in;
     while (forward.position() < turn_point) {
@@ -191,6 +202,9 @@ public:
         break;
       }
     }
+    float error = forward.position() - turn_point;
+    turn_triggers.record(turn_id, left_wall, right_wall, front_wall, triggered, error, sensors.get_front_sum(), params.trigger);
+    recorder.signal_event(EVENT_TURN_START);
     if (triggered) {
       reporter.log_status('S', location, heading); // the sensors triggered the turn
     } else {
@@ -214,9 +228,10 @@ public:
     float remaining = (FULL_CELL + HALF_CELL) - forward.position();
     forward.start(remaining, forward.speed(), 30, forward.acceleration());
     if (has_wall) {
-      while (sensors.get_front_sum() < FRONT_REFERENCE) {
+      while (sensors.get_front_distance() > FRONT_REFERENCE_DISTANCE) {
         delay(2);
       }
+      recorder.signal_event(EVENT_WALL_STOP);
     } else {
       forward.wait_until_finished();
     }
@@ -285,6 +300,8 @@ public:
     forward.wait_until_finished();
     forward.set_position(HALF_CELL);
     console.println(F("Off we go..."));
+    // the log must never hold up a decision
+    console.set_blocking(false);
     motion.wait_until_position(FULL_CELL - 10);
     // at the start of this loop we are always at the sensing point
     while (location != target) {
@@ -326,12 +343,14 @@ public:
         reporter.log_status('x', location, heading);
       }
     }
+    console.set_blocking(true);
     console.println();
     console.println(F("Arrived!  "));
     delay(250);
     sensors.disable();
 
     motion.reset_drive_system();
+    turn_triggers.save();
   }
 
   /***
@@ -370,6 +389,8 @@ public:
     forward.wait_until_finished();
     forward.set_position(HALF_CELL);
     console.println(F("Off we go..."));
+    // the log must never hold up a decision
+    console.set_blocking(false);
     motion.wait_until_position(SENSING_POSITION);
     // TODO. the robot needs to start each iteration at the sensing point
     while (location != target) {
@@ -417,6 +438,7 @@ public:
       }
     }
     sensors.disable();
+    console.set_blocking(true);
     console.println();
     console.println(F("Arrived!  "));
     delay(250);
@@ -526,6 +548,7 @@ public:
     handStart = false;
     search_to(START);
     motors.stop();
+    turn_triggers.save();
     return 0;
   }
 
@@ -568,6 +591,59 @@ public:
     sensors.disable();
   }
 
+  void print_sensor_table(const __FlashStringHelper *name, const int *table) {
+    console.print(F("const int "));
+    console.print(name);
+    console.print(F("_TABLE[SENSOR_TABLE_SIZE] PROGMEM = {"));
+    for (int i = 0; i < SENSOR_TABLE_SIZE; i++) {
+      console.print(table[i]);
+      if (i < SENSOR_TABLE_SIZE - 1) {
+        console.print(F(", "));
+      }
+    }
+    console.println(F("};"));
+  }
+
+  /***
+   * Calibration sweep for the front sensor linearisation tables.
+   *
+   * Put the robot backed up to a wall with an open cell ahead and a wall at
+   * the far side of the next cell. The robot centre is then two cells, less
+   * a wall thickness and BACK_WALL_TO_CENTER, from that wall. The robot
+   * creeps forward until it is SENSOR_TABLE_START from the wall, taking the
+   * normalised front readings as it passes each table distance. Calibrate
+   * the sensors first so that the tables match the nominal readings.
+   *
+   * The tables are printed ready to paste into the robot config file.
+   */
+  void calibrate_front_sensor_tables() {
+    int left[SENSOR_TABLE_SIZE];
+    int right[SENSOR_TABLE_SIZE];
+    float start = 2 * FULL_CELL - WALL_THICKNESS - BACK_WALL_TO_CENTER;
+    sensors.enable();
+    motion.reset_drive_system();
+    sensors.set_steering_mode(STEERING_OFF);
+    forward.start(start - SENSOR_TABLE_START, 100, 0, 500);
+    int i = SENSOR_TABLE_SIZE - 1;
+    while (i >= 0 && not forward.is_finished()) {
+      float distance = start - forward.position();
+      if (distance <= SENSOR_TABLE_START + i * SENSOR_TABLE_STEP) {
+        left[i] = sensors.lfs.value;
+        right[i] = sensors.rfs.value;
+        i--;
+      }
+    }
+    // the last entry may be reached just as the move finishes
+    for (; i >= 0; i--) {
+      left[i] = sensors.lfs.value;
+      right[i] = sensors.rfs.value;
+    }
+    motion.reset_drive_system();
+    sensors.disable();
+    print_sensor_table(F("LFS"), left);
+    print_sensor_table(F("RFS"), right);
+  }
+
   /**
    * By turning in place through 360 degrees, it should be possible to get a
    * sensor calibration for all sensors?
@@ -726,11 +802,119 @@ public:
     motion.reset_drive_system();
   }
 
+  /***
+   * Measure the steady state speed of each wheel over a short period with
+   * the motors running open loop. The individual wheel movements are
+   * recovered from the robot distance and angle. The time comes from the
+   * number of control ticks between the two snapshots so it matches the
+   * encoder readings exactly.
+   */
+  void measure_wheel_speeds(float &left_speed, float &right_speed, int interval_ms) {
+    ControlSnapshot start = systick.read_snapshot();
+    delay(interval_ms);
+    ControlSnapshot end = systick.read_snapshot();
+    float fwd = end.robot_distance - start.robot_distance;
+    float rot = (end.robot_angle - start.robot_angle) * (1.0f / DEG_PER_MM_DIFFERENCE);
+    float seconds = (end.ticks - start.ticks) * LOOP_INTERVAL;
+    left_speed = (fwd - 0.5f * rot) / seconds;
+    right_speed = (fwd + 0.5f * rot) / seconds;
+  }
+
+  void print_feedforward_table(const __FlashStringHelper *name, FeedForwardTable &ff) {
+    console.print(F("const float "));
+    console.print(name);
+    console.print(F("_BIAS_FF = "));
+    console.print(ff.bias, 3);
+    console.println(';');
+    console.print(F("const float "));
+    console.print(name);
+    console.print(F("_FF_TABLE[FF_TABLE_SIZE] PROGMEM = {"));
+    for (int i = 0; i < FF_TABLE_SIZE; i++) {
+      console.print(ff.volts[i], 3);
+      if (i < FF_TABLE_SIZE - 1) {
+        console.print(F(", "));
+      }
+    }
+    console.println(F("};"));
+  }
+
+  /***
+   * Characterise the drive motors to fill in the feedforward tables.
+   *
+   * Put the robot on a block so that the wheels are clear of the floor.
+   *
+   * First, the voltage to each motor is slowly increased until the wheel
+   * starts to turn. That is the bias needed to overcome static friction.
+   * Then a series of fixed voltages, from 0.5 Volts to 5 Volts in steps of
+   * 0.5 Volts, is applied and the steady state speed of each wheel recorded.
+   * The feedforward tables are interpolated from those measurements.
+   *
+   * The new tables are used straight away but are lost at reset. They are
+   * printed out so that they can be pasted into the robot config file.
+   */
+  void test_motor_characterisation() {
+    const int STEPS = 11; // the bias plus ten voltage steps
+    float volts[STEPS];
+    float left_speed[STEPS];
+    float right_speed[STEPS];
+    float left_bias = 0;
+    float right_bias = 0;
+    motion.reset_drive_system();
+    motors.disable_controllers();
+    console.println(F("Motor characterisation"));
+    // find the static friction for each wheel
+    for (float v = 0; v < 2.0; v += 0.02) {
+      float left, right;
+      if (left_bias == 0) {
+        motors.set_left_motor_volts(v);
+      }
+      if (right_bias == 0) {
+        motors.set_right_motor_volts(v);
+      }
+      measure_wheel_speeds(left, right, 50);
+      if (left_bias == 0 && left > 10) {
+        left_bias = v;
+      }
+      if (right_bias == 0 && right > 10) {
+        right_bias = v;
+      }
+      if (left_bias > 0 && right_bias > 0) {
+        break;
+      }
+    }
+    motors.stop();
+    delay(500);
+    volts[0] = 0;
+    left_speed[0] = 0;
+    right_speed[0] = 0;
+    for (int i = 1; i < STEPS; i++) {
+      volts[i] = 0.5f * i;
+      motors.set_left_motor_volts(volts[i]);
+      motors.set_right_motor_volts(volts[i]);
+      delay(300); // let the speed settle
+      measure_wheel_speeds(left_speed[i], right_speed[i], 200);
+      print_justified(int(1000 * volts[i]), 6);
+      print_justified(int(left_speed[i]), 6);
+      print_justified(int(right_speed[i]), 6);
+      console.println();
+    }
+    motors.stop();
+    // the first point is the bias voltage at zero speed
+    volts[0] = left_bias;
+    motors.fit_feedforward(motors.left_feedforward(), volts, left_speed, STEPS, left_bias);
+    volts[0] = right_bias;
+    motors.fit_feedforward(motors.right_feedforward(), volts, right_speed, STEPS, right_bias);
+    print_feedforward_table(F("LEFT"), motors.left_feedforward());
+    print_feedforward_table(F("RIGHT"), motors.right_feedforward());
+    motion.reset_drive_system();
+  }
+
   /***
    * loop until the user button is pressed while
    * pumping out sensor readings. The first four numbers are
    * the raw readings, the next four are normalised then there
-   * are two values for the sum and difference of the front sensors
+   * are two values for the sum and difference of the front sensors.
+   * The last four are the distances to the walls in mm.
    *
    * The advanced user might use this as a start for auto calibration
    */
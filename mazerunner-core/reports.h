@@ -18,12 +18,20 @@
 #define LOGGER_H
 
 #include "reports.h"
+#include "calibration.h"
+#include "maze.h"
 #include "src/encoders.h"
+#include "src/memory.h"
 #include "src/motors.h"
 #include "src/profile.h"
+#include "src/profiler.h"
+#include "src/recorder.h"
 #include "src/sensors.h"
 #include "src/serial.h"
+#include "src/systick.h"
+#include "src/telemetry.h"
 #include "src/utils.h"
+#include "turn_triggers.h"
 #include <Arduino.h>
 
 const char hdg_letters[] = "FRAL";
@@ -36,8 +44,34 @@ class Reporter {
   uint32_t s_start_time;
   uint32_t s_report_time;
   uint32_t s_report_interval = REPORTING_INTERVAL;
+  bool m_binary = false;
+  uint16_t m_console_drops = 0;
 
 public:
+  /***
+   * In binary mode, the profile and sensor track reports start the binary
+   * telemetry stream instead of printing lines of text. The stream carries
+   * the same values, and more, for every control tick. See src/telemetry.h.
+   * The stream stops at the end of the command.
+   */
+  void set_binary_mode(bool binary) {
+#if TELEMETRY
+    m_binary = binary;
+#endif
+  }
+
+  bool binary_mode() {
+    return m_binary;
+  }
+
+  void end_reports() {
+#if TELEMETRY
+    if (telemetry.active()) {
+      telemetry.stop();
+    }
+#endif
+  }
+
   // note that the console device has a 64 character buffer and, at 115200 baud
   // 64 characters will take about 6ms to go out over the wire.
 
@@ -62,23 +96,36 @@ public:
    *
    */
   void report_profile_header() {
+#if TELEMETRY
+    if (m_binary) {
+      telemetry.start();
+      return;
+    }
+#endif
     console.println(F("time robotPos robotAngle fwdPos  fwdSpeed rotpos rotSpeed fwdmVolts rotmVolts"));
     s_start_time = millis();
     s_report_time = s_start_time;
   }
 
   void report_profile() {
+#if TELEMETRY
+    if (telemetry.active()) {
+      telemetry.send();
+      return;
+    }
+#endif
     if (millis() >= s_report_time) {
       s_report_time += s_report_interval;
+      ControlSnapshot s = systick.read_snapshot();
       print_justified(int(millis() - s_start_time), 6);
-      print_justified(int(encoders.robot_distance()), 6);
-      print_justified(int(encoders.robot_angle()), 6);
-      print_justified(int(forward.position()), 6);
-      print_justified(int(forward.speed()), 6);
-      print_justified(int(rotation.position()), 6);
-      print_justified(int(rotation.speed()), 6);
-      print_justified(motors.get_fwd_millivolts(), 6);
-      print_justified(motors.get_rot_millivolts(), 6);
+      print_justified(int(s.robot_distance), 6);
+      print_justified(int(s.robot_angle), 6);
+      print_justified(int(s.fwd_position), 6);
+      print_justified(int(s.fwd_speed), 6);
+      print_justified(int(s.rot_position), 6);
+      print_justified(int(s.rot_speed), 6);
+      print_justified(s.fwd_millivolts, 6);
+      print_justified(s.rot_millivolts, 6);
       console.println();
     }
   }
@@ -97,17 +144,30 @@ public:
    *
    */
   void report_sensor_track_header() {
+#if TELEMETRY
+    if (m_binary) {
+      telemetry.start();
+      return;
+    }
+#endif
     console.println(F("time pos angle left right front error adjustment"));
     s_start_time = millis();
     s_report_time = s_start_time;
   }
 
   void report_sensor_track(bool use_raw = false) {
+#if TELEMETRY
+    if (telemetry.active()) {
+      telemetry.send();
+      return;
+    }
+#endif
     if (millis() >= s_report_time) {
       s_report_time += s_report_interval;
+      ControlSnapshot s = systick.read_snapshot();
       print_justified(int(millis() - s_start_time), 6);
-      print_justified(int(encoders.robot_distance()), 6);
-      print_justified(int(encoders.robot_angle()), 6);
+      print_justified(int(s.robot_distance), 6);
+      print_justified(int(s.robot_angle), 6);
       if (use_raw) {
         print_justified(sensors.lfs.raw, 6);
         print_justified(sensors.lss.raw, 6);
@@ -120,9 +180,9 @@ public:
         print_justified(sensors.rfs.value, 6);
       }
       console.print(' ');
-      console.print(sensors.get_cross_track_error());
+      console.print(s.cross_track_error);
       console.print(' ');
-      console.print(sensors.get_steering_feedback());
+      console.print(s.steering_feedback);
       console.println();
     }
   }
@@ -169,7 +229,7 @@ public:
    *
    */
   void wall_sensor_header() {
-    console.println(F("   lf_   ls_   rs_   rf_   lfs   lss   rss   rfs   sum  diff"));
+    console.println(F("   lf_   ls_   rs_   rf_   lfs   lss   rss   rfs   sum  diff   lfd   lsd   rsd   rfd"));
   }
 
   void show_wall_sensors() {
@@ -185,9 +245,271 @@ public:
     console.print(" | ");
     print_justified(sensors.get_front_sum(), 6);
     print_justified(sensors.get_front_diff(), 6);
+    console.print(" | ");
+    print_justified(sensors.lfs.distance, 6);
+    print_justified(sensors.lss.distance, 6);
+    print_justified(sensors.rss.distance, 6);
+    print_justified(sensors.rfs.distance, 6);
+    console.println();
+  }
+
+  //***************************************************************************//
+  /***
+   * Show how long the systick ISR takes and how much of the processor is
+   * left for the main loop. The figures cover the time since the last call.
+   *
+   * Load is the average time from the start of the ISR to its end as a
+   * percentage of the tick period. That includes any ADC interrupts that run
+   * while systick is active but not the time it spent waiting to start. The
+   * main loop gets whatever is left. Its pass rate shows how quickly it can
+   * respond to the serial port and the switches.
+   *
+   * The sensor cycle starts as the ISR finishes. It has to be complete
+   * before the next sensor task runs. The longest time from the timer tick
+   * to the end of the ISR and the longest sensor cycle together must fit in
+   * the sensor period. The budget line checks that and that no tick overran.
+   */
+  void show_systick_timing() {
+    uint16_t cycle_time = adc.read_cycle_time();
+    SystickTiming t = systick.read_timing();
+    if (t.ticks == 0) {
+      console.println(F("No systick data"));
+      return;
+    }
+    const float us = SYSTICK_US_PER_COUNT;
+    float avg = us * t.busy_sum / t.ticks;
+    float load = 100.0f * avg / (1000000.0f * SYSTICK_INTERVAL);
+    float seconds = t.ticks * SYSTICK_INTERVAL;
+    console.print(F("ticks "));
+    console.print(t.ticks);
+    console.print(F(" in "));
+    console.print(seconds, 2);
+    console.println(F("s"));
+    console.print(F("isr us       min "));
+    console.print(us * t.busy_min, 0);
+    console.print(F("  avg "));
+    console.print(avg, 0);
+    console.print(F("  max "));
+    console.print(us * t.busy_max, 0);
+    console.print(F("  to end "));
+    console.println(us * t.duration_max, 0);
+    console.print(F("latency us   min "));
+    console.print(us * t.latency_min, 0);
+    console.print(F("  max "));
+    console.print(us * t.latency_max, 0);
+    console.print(F("  jitter "));
+    console.println(us * t.jitter_max, 0);
+    console.print(F("late "));
+    console.print(t.late);
+    console.print(F("  overruns "));
+    console.println(t.overruns);
+    console.print(F("systick load "));
+    console.print(load, 1);
+    console.print(F("%  main loop "));
+    console.print(100.0f - load, 1);
+    console.print(F("% at "));
+    console.print(t.loops / seconds, 0);
+    console.println(F(" passes/s"));
+    float sensor_period = 1000000.0f / SENSOR_FREQUENCY;
+    float used = us * t.duration_max + cycle_time;
+    console.print(F("sensor cycle us max "));
+    console.print(cycle_time);
+    console.print(F("  isr + cycle "));
+    console.print(used, 0);
+    console.print(F(" of "));
+    console.println(sensor_period, 0);
+    console.print(F("budget at "));
+    console.print(SYSTICK_HZ);
+    console.print(F("Hz "));
+    if (t.overruns == 0 && used < sensor_period) {
+      console.println(F("OK"));
+    } else {
+      console.println(F("EXCEEDED"));
+    }
+  }
+
+  //***************************************************************************//
+  /***
+   * Show where the RAM goes. The sizes of the larger global objects are
+   * listed first. They are all part of the static RAM. The queue used by
+   * the maze flood is on the stack while the flood runs so it is listed
+   * separately. Then comes the stack high-water mark. See src/memory.h.
+   */
+  void show_memory() {
+    if (not memory.available()) {
+      console.println(F("No memory figures for this target"));
+      return;
+    }
+    console.println(F("static bytes"));
+    print_ram_size(F("maze (noinit)"), sizeof(maze));
+    print_ram_size(F("sensors"), sizeof(sensors));
+    print_ram_size(F("adc"), sizeof(adc));
+    print_ram_size(F("motors"), sizeof(motors));
+    print_ram_size(F("encoders"), sizeof(encoders));
+    print_ram_size(F("profiles"), sizeof(forward) + sizeof(rotation));
+    print_ram_size(F("systick"), sizeof(systick));
+    print_ram_size(F("calibration"), sizeof(calibration));
+    print_ram_size(F("triggers"), sizeof(turn_triggers));
+#if TELEMETRY
+    print_ram_size(F("telemetry"), sizeof(telemetry));
+#endif
+    print_ram_size(F("console"), sizeof(console));
+    print_ram_size(F("recorder (noinit)"), sizeof(recorder));
+#if PROFILING
+    print_ram_size(F("profiler"), sizeof(profiler));
+#endif
+    print_ram_size(F("noinit"), memory.noinit_ram());
+    print_ram_size(F("total"), memory.static_ram());
+    console.println(F("stack bytes"));
+    print_ram_size(F("flood queue"), sizeof(Queue<uint8_t, 64>));
+    print_ram_size(F("deepest"), memory.stack_used());
+    console.println(F("free bytes"));
+    print_ram_size(F("heap used"), memory.heap_used());
+    print_ram_size(F("free now"), memory.free_ram());
+    print_ram_size(F("worst"), memory.stack_margin());
+    print_ram_size(F("of total"), memory.total_ram());
+  }
+
+  /***
+   * A one line version for the end of a run. The worst case margin is the
+   * number to watch. If it gets close to zero the stack has nearly hit the
+   * heap.
+   */
+  void show_stack_use() {
+    if (not memory.available()) {
+      return;
+    }
+    console.print(F("stack "));
+    console.print(memory.stack_used());
+    console.print(F(" margin "));
+    console.print(memory.stack_margin());
+    if (memory.stack_margin() < STACK_MARGIN_WARNING) {
+      console.print(F(" LOW"));
+    }
     console.println();
   }
 
+  // a one line note at the end of a run if any log output was lost
+  void show_console_drops() {
+    uint16_t dropped = console.dropped();
+    if (dropped == m_console_drops) {
+      return;
+    }
+    console.print(F("console dropped "));
+    console.print(dropped - m_console_drops);
+    console.println(F(" bytes"));
+    m_console_drops = dropped;
+  }
+
+  void print_ram_size(const __FlashStringHelper *name, int size) {
+    console.print(F("  "));
+    console.print(name);
+    console.print(' ');
+    console.println(size);
+  }
+
+  /***
+   * Print the flight recorder, oldest sample first. The recorder is frozen
+   * first if it is still running. The errors are in hundredths of a mm or a
+   * degree. The event column shows any marks made by the main code.
+   */
+  void show_flight_record() {
+    recorder.freeze(FREEZE_COMMAND);
+    console.print(F("Flight record: "));
+    switch (recorder.reason()) {
+      case FREEZE_COMMAND:
+        console.print(F("command"));
+        break;
+      case FREEZE_CRASH:
+        console.print(F("CRASH"));
+        break;
+      case FREEZE_RUN_END:
+        console.print(F("run end"));
+        break;
+      case FREEZE_RESET:
+        console.print(F("RESET"));
+        break;
+      case FREEZE_TRIGGER:
+        console.print(F("trigger"));
+        break;
+      default:
+        console.print(F("empty"));
+        break;
+    }
+    console.print(F(", "));
+    console.print(recorder.count());
+    console.print(F(" samples every "));
+    console.print(recorder.decimation() * LOOP_INTERVAL * 1000, 1);
+    console.println(F("ms"));
+    if (recorder.count() == 0) {
+      return;
+    }
+    console.println(F(" tick  fwd_v  rot_v fwd_err rot_err fwd_mv rot_mv cte ev"));
+    int trigger = recorder.trigger_sample();
+    for (uint16_t i = 0; i < recorder.count(); i++) {
+      const FlightSample &f = recorder.sample(i);
+      print_justified((int32_t)f.tick, 5);
+      print_justified(f.fwd_speed, 7);
+      print_justified(f.rot_speed, 7);
+      print_justified(f.fwd_error, 8);
+      print_justified(f.rot_error, 8);
+      print_justified(f.fwd_millivolts, 7);
+      print_justified(f.rot_millivolts, 7);
+      print_justified(f.cross_track_error, 4);
+      console.print(' ');
+      console.print(f.event ? f.event : '.');
+      if ((int)i == trigger) {
+        console.print(F(" <- trigger"));
+      }
+      console.println();
+    }
+  }
+
+  void show_recorder_trigger() {
+    int level = recorder.trigger_level();
+    console.print(F("Trigger: "));
+    switch (recorder.trigger_source()) {
+      case TRIGGER_LFS:
+        console.print(F("LFS >= "));
+        console.print(level);
+        break;
+      case TRIGGER_LSS:
+        console.print(F("LSS >= "));
+        console.print(level);
+        break;
+      case TRIGGER_RSS:
+        console.print(F("RSS >= "));
+        console.print(level);
+        break;
+      case TRIGGER_RFS:
+        console.print(F("RFS >= "));
+        console.print(level);
+        break;
+      case TRIGGER_FWD_ERROR:
+        console.print(F("FWD_ERR >= "));
+        console.print(level / 100.0f, 2);
+        break;
+      case TRIGGER_ROT_ERROR:
+        console.print(F("ROT_ERR >= "));
+        console.print(level / 100.0f, 2);
+        break;
+      case TRIGGER_EVENT:
+        console.print(F("event "));
+        console.print((char)level);
+        break;
+      default:
+        console.print(F("OFF"));
+        break;
+    }
+    console.print(F(", "));
+    console.print(RECORDER_SAMPLES - 1 - recorder.post_trigger());
+    console.print(F(" samples before, "));
+    console.print(recorder.post_trigger());
+    console.print(F(" after, every "));
+    console.print(recorder.decimation() * LOOP_INTERVAL * 1000, 1);
+    console.println(F("ms"));
+  }
+
   //***************************************************************************//
   void print_walls() {
     if (sensors.see_left_wall) {
@@ -209,6 +531,7 @@ public:
 
   //***************************************************************************//
   void log_status(char action, uint8_t location, uint8_t heading) {
+    recorder.mark(action);
     console.print('{');
     console.print(action);
     console.print(' ');
@@ -4,7 +4,7 @@
  * File Created: Wednesday, 26th October 2022 10:51:51 pm                     *
  * Author: Peter Harrison                                                     *
  * -----                                                                      *
- * Last Modified: Wednesday, 2nd November 2022 12:58:56 pm                    *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
  * -----                                                                      *
  * Copyright 2022 - 2022 Peter Harrison, Micromouseonline                     *
  * -----                                                                      *
@@ -17,34 +17,34 @@
 #ifndef ADC_H
 #define ADC_H
 
+#include "atomic.h"
 #include "digitalWriteFast.h"
-#include "list.h"
+#include "profiler.h"
 #include <Arduino.h>
 
 /***
- * This is an interface class for an actual adc subsystem. It is a pure
- * virtual class and cannot be instantiated. Instead, you must create
- * a derived class with appropriate code for the target hardware.
+ * This is the base class for an actual adc subsystem. It cannot do anything
+ * by itself. Instead, you must create a derived class with appropriate code
+ * for the target hardware.
  *
- * Currently there are 8 available channels and 2 groups.
+ * Currently there are 8 available channels and up to 4 groups.
  *
  * The channels currently refer to the hardware ADC channel numbers,
  * starting at zero.
- * TODO: A future development should allow the use of any subset of
- * hardware channels.
  *
- * It is expected that all the channels will be read at least once in a
- * conversion cycle. These are the 'dark' readings.
+ * Only the channels that have been registered are converted. A channel
+ * that is only needed as a plain reading, like the battery voltage or the
+ * analogue switches, is registered with add_channel(). A sensor channel is
+ * registered by adding it to a group with add_channel_to_group(). Channels
+ * that are not registered are never converted and will always read zero.
  *
- * This is done on the assumption that not all adc channels are associated
- * with active sensors. For example, on the basic UKMARSBOT, one of the
- * channels is used for the battery voltage measurement and another is
- * used for the analogue switches. Using this technique, the battery monitor
- * and switches just need to grab a reading for the adc converter. If
- * your platform has a different arrangement it should not be affected
- * by this ADC code.
+ * Every registered channel is read once at the start of a conversion cycle
+ * with all the emitters off. These are the 'dark' readings. Using this
+ * technique, the battery monitor and switches just need to grab a reading
+ * from the adc converter. If your platform has a different arrangement it
+ * should not be affected by this ADC code.
  *
- * After the first read each group will be read again with its associated
+ * After the dark reads, each group is read again with its associated
  * emitter pin set high. The result for that channel will then be the
  * difference between 'lit' reading and the previous 'dark' reading.
  *
@@ -56,21 +56,38 @@
  * A pin number of 255 is treated as a null value and will be ignored
  * for all operations.
  *
- * Any, or all, of the channels can be added to one (or both) of the
- * groups. At present the groups are hard-coded in sequence in the
- * hardware implementation.
+ * A channel can belong to only one group since it has only one dark reading
+ * to subtract. Adding it to another group moves it. A group can hold any
+ * number of channels. Groups that have no channels, or no emitter pin, are
+ * left out of the cycle.
  *
  * Before the converter is used, you should assign emitter pin numbers to
- * each group. If there is no pin number assigned, the channels in group
- * will still be read a second time and so are likely to return a value of
- * zero. TODO: this needs to be fixed
+ * each group and allocate channel numbers to the groups. These are the
+ * channels that will get a second read with the associated emitter lit.
  *
- * Next, each group should have one or more channel numbers allocated to it.
- * These are the channels that will get a second read with the associated
- * emitter lit.
+ * Any channel can be oversampled to reduce noise. set_oversampling() gives
+ * the number of conversions, as a power of two, that are added together for
+ * each reading and a right shift for the sum. The dark and lit reads of a
+ * channel are treated the same way so the difference is still valid.
+ * Hardware that can accumulate samples itself, like the ATmega4809, sets
+ * HARDWARE_ACCUMULATION and gets the whole sum from one conversion request.
+ * Otherwise the ISR repeats the conversion and adds up the results.
+ *
+ * The ADC clock divider can be set with set_clock_divider(). The default of
+ * 32 suits a 2ms sensor cycle. A divider of 16 halves the conversion time.
+ * The settling time of the sensors does not change so each group then gets
+ * two settling conversions.
+ *
+ * The time taken by each conversion cycle is measured. read_cycle_time()
+ * gives the longest since it was last called so that it can be checked
+ * against the sensor period.
  *
  * Once the emitters and groups have been assigned, call the begin() method
  * to configure the underlying hardware ADC and allow conversion cycle to begin.
+ * begin() turns the channel and group settings into a sequence table. The
+ * table holds one step for each conversion in the cycle so the ISR does not
+ * need to work anything out as it goes along. Changes made after begin()
+ * has been called will have no effect.
  *
  * It is assumed that the conversion cycle happens under interrupt control and
  * is triggered at the end of the systick function by calling the
@@ -85,21 +102,61 @@
  * Attempting to performa a manual ADC conversion will disrupt that
  * process so avoid doing that if you value your sanity.
  *
- * The use of virtual functions comes at some small cost. The VTABLE
- * takes up at least another 8 bytes and there is an overhead in the
- * function call. If this is a problem consider the use of CRTP techniques.
+ * The converter uses the Curiously Recurring Template Pattern (CRTP). The
+ * hardware class is derived from AnalogueConverter<hardware class> and the
+ * adc_isr() state machine is a template that gets compiled for the actual
+ * hardware class. There are no virtual functions so there is no VTABLE and
+ * the compiler is free to inline the hardware methods. In the ISR, that
+ * turns each call into a few direct register accesses. Just as important,
+ * the ISR no longer has to save and restore all the call-clobbered registers
+ * around an indirect call that the compiler cannot see into.
+ *
+ * The hardware class MUST provide these members:
+ *
+ *   static const bool HARDWARE_ACCUMULATION;
+ *   void begin();  // must call build_sequence()
+ *   void start_conversion_cycle();
+ *   void end_conversion_cycle();
+ *   void start_conversion(uint8_t channel, uint8_t oversample = 0);
+ *   int get_adc_result();
+ *   void emitter_on(uint8_t pin);
+ *   void emitter_off(uint8_t pin);
  */
-class IAnalogueConverter {
+template <class HARDWARE>
+class AnalogueConverter {
 public:
   enum {
-    MAX_GROUPS = 2,
+    MAX_GROUPS = 4,
     MAX_CHANNELS = 8,
+    // every channel read dark and lit plus up to two settling steps per group
+    MAX_STEPS = 2 * MAX_CHANNELS + 2 * MAX_GROUPS,
+    // 64 samples of a 10 bit result is the most that fits in 16 bits
+    MAX_OVERSAMPLE = 6,
   };
 
-  IAnalogueConverter() {
+  // the things that a step in the sequence can do
+  enum {
+    STEP_STORE = 0x01,       // save the result as the channel reading
+    STEP_SUBTRACT = 0x02,    // save the result less the dark reading
+    STEP_EMITTER_ON = 0x04,  // turn on the emitter before the conversion
+    STEP_EMITTER_OFF = 0x08, // turn off the emitter after the conversion
+  };
+
+  struct Step {
+    uint8_t channel;
+    uint8_t action;
+    uint8_t pin;
+  };
+
+  AnalogueConverter() {
     for (int i = 0; i < MAX_GROUPS; i++) {
       m_emitter_pin[i] = 255; // pin 255 is a null, or invalid pin
     }
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+      m_channel_group[i] = UNUSED;
+      m_oversample[i] = 0;
+      m_result_shift[i] = 0;
+    }
   }
 
   void set_emitter_for_group(uint8_t pin, uint8_t group) {
@@ -110,6 +167,16 @@ public:
     m_emitter_pin[group] = pin;
   };
 
+  // a channel that is only read dark. The battery monitor for example.
+  void add_channel(uint8_t channel) {
+    if (channel >= MAX_CHANNELS) {
+      return;
+    }
+    if (m_channel_group[channel] == UNUSED) {
+      m_channel_group[channel] = DARK_ONLY;
+    }
+  };
+
   void add_channel_to_group(uint8_t channel, uint8_t group) {
     if (channel >= MAX_CHANNELS) {
       return;
@@ -117,9 +184,42 @@ public:
     if (group >= MAX_GROUPS) {
       return;
     }
-    m_group[group].add(channel);
+    m_channel_group[channel] = group;
   };
 
+  /***
+   * Each reading from the channel becomes the sum of 2^oversample conversions
+   * shifted right by result_shift. The shift is raised if needed so that the
+   * reading will always fit in an int.
+   */
+  void set_oversampling(uint8_t channel, uint8_t oversample, uint8_t result_shift) {
+    if (channel >= MAX_CHANNELS) {
+      return;
+    }
+    oversample = min(oversample, (uint8_t)MAX_OVERSAMPLE);
+    result_shift = max(result_shift, (uint8_t)(oversample > 5 ? oversample - 5 : 0));
+    m_oversample[channel] = oversample;
+    m_result_shift[channel] = result_shift;
+  }
+
+  // 16 or 32. Anything else gives 32.
+  void set_clock_divider(uint8_t divider) {
+    m_clock_divider = divider == 16 ? 16 : 32;
+  }
+
+  /***
+   * Get the longest conversion cycle, in microseconds, since the last call
+   * and start again.
+   */
+  uint16_t read_cycle_time() {
+    uint16_t cycle_time;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      cycle_time = m_cycle_time_max;
+      m_cycle_time_max = 0;
+    }
+    return cycle_time;
+  }
+
   void enable_emitters() {
     m_emitters_enabled = true;
   }
@@ -131,31 +231,184 @@ public:
   // for convenience allow access in an array-like manner
   volatile int &operator[](int i) { return m_adc_reading[i]; }
 
-  // all of these MUST be defined in the derived hardware class
-  virtual void begin() = 0;
-  virtual void start_conversion_cycle() = 0;
-  virtual void end_conversion_cycle() = 0;
-  virtual void start_conversion(uint8_t channel) = 0;
-  virtual int get_adc_result() = 0;
-  virtual void emitter_on(uint8_t pin) = 0;
-  virtual void emitter_off(uint8_t pin) = 0;
-
   // an external function called from the hardware end of conversion ISR
-  friend void adc_isr(IAnalogueConverter &a);
+  template <class T>
+  friend void adc_isr(T &adc);
 
 protected:
+  enum {
+    DARK_ONLY = 254,
+    UNUSED = 255,
+  };
+
+  /***
+   * Turn the channel and group settings into the sequence table. The dark
+   * reads come first so that the cycle can simply stop after them when the
+   * emitters are disabled.
+   *
+   * Each group then gets a settling step that turns on its emitter and
+   * performs a conversion that is thrown away. That gives the sensors one
+   * conversion time to respond. With the faster ADC clock there is a second
+   * settling step to make up the time. The last lit read of the group turns
+   * the emitter off again.
+   */
+  void build_sequence() {
+    uint8_t settle_steps = m_clock_divider < 32 ? 2 : 1;
+    uint8_t count = 0;
+    for (uint8_t channel = 0; channel < MAX_CHANNELS; channel++) {
+      if (m_channel_group[channel] != UNUSED) {
+        m_sequence[count++] = {channel, STEP_STORE, 255};
+      }
+    }
+    m_dark_steps = count;
+    for (uint8_t group = 0; group < MAX_GROUPS; group++) {
+      uint8_t pin = m_emitter_pin[group];
+      if (pin == 255) {
+        continue;
+      }
+      uint8_t first = count;
+      for (uint8_t channel = 0; channel < MAX_CHANNELS; channel++) {
+        if (m_channel_group[channel] != group) {
+          continue;
+        }
+        if (count == first) {
+          m_sequence[count++] = {channel, STEP_EMITTER_ON, pin};
+          for (uint8_t i = 1; i < settle_steps; i++) {
+            m_sequence[count++] = {channel, 0, pin};
+          }
+        }
+        m_sequence[count++] = {channel, STEP_SUBTRACT, pin};
+      }
+      if (count > first) {
+        m_sequence[count - 1].action |= STEP_EMITTER_OFF;
+      }
+    }
+    m_total_steps = count;
+  }
+
   volatile int m_adc_reading[MAX_CHANNELS] = {0};
 
   uint8_t m_emitter_pin[MAX_GROUPS] = {0};
+  uint8_t m_channel_group[MAX_CHANNELS];
+  uint8_t m_oversample[MAX_CHANNELS];
+  uint8_t m_result_shift[MAX_CHANNELS];
 
-  List<uint8_t, MAX_CHANNELS> m_group[MAX_GROUPS];
-
-  uint8_t m_index = 0;
-  uint8_t m_group_index = 0;
+  Step m_sequence[MAX_STEPS];
+  uint8_t m_dark_steps = 0;
+  uint8_t m_total_steps = 0;
+  uint8_t m_last_step = 0; // latched at the start of each cycle
+  uint8_t m_step = 0;      // used in the isr
+  uint8_t m_sample = 0;    // used in the isr
+  uint16_t m_sum = 0;      // used in the isr
+  uint8_t m_clock_divider = 32;
+  uint32_t m_cycle_start = 0;
+  volatile uint16_t m_cycle_time_max = 0;
 
   bool m_emitters_enabled = false;
   bool m_configured = false;
-  uint8_t m_phase = 0; // used in the isr
 };
 
-#endif
\ No newline at end of file
+/***
+ * This function should be independent of the hardware but is called from the
+ * hardware end-of-conversion ISR.
+ *
+ * In the adc base class, it is declared as a friend so that it can access
+ * the methods and properties of the actual class instance. Because it is a
+ * template, it is compiled for the actual hardware class and all the calls
+ * to that class can be inlined.
+ *
+ *
+ * @brief Sample all the sensor channels with and without the emitter on
+ *
+ * At the end of the systick sensor task, the ADC interrupt is enabled
+ * and a dummy conversion started. After each ADC conversion the interrupt
+ * gets generated and this ISR is called. Each call deals with the result of
+ * the step that just finished and then starts the conversion for the next
+ * step in the sequence table built by begin().
+ *
+ * m_step counts the steps that have been started so the result always
+ * belongs to the step before it. The first call only has the result of the
+ * dummy conversion, which is discarded.
+ *
+ * Whether the emitters are enabled is checked once, at the start of the
+ * cycle. With them disabled, the cycle ends after the dark reads. Otherwise
+ * the whole table is run. Latching the decision means an emitter that has
+ * been turned on will always get turned off again.
+ *
+ * After the last step, the ADC interrupt is disabled and the sensors are
+ * idle until triggered again.
+ *
+ * A channel that is oversampled on hardware without accumulation stays on
+ * the same step while the ISR repeats the conversion and adds up the
+ * results. Only when the sum is complete is it scaled and stored and the
+ * emitter, if needed, turned off. The settling steps are never oversampled.
+ *
+ * The ADC service runs all the time even with the sensors 'disabled'. In this
+ * software, 'enabled' only means that the emitters are turned on in the second
+ * phase. Without that, you might expect the sensor readings to be zero.
+ *
+ * With the default configuration there are six dark reads, two settling
+ * conversions and four lit reads. Before the sequence table, all eight
+ * channels were read dark every cycle whether they were used or not.
+ *
+ * There are actually 16 available channels on the ATMEGA328p and channel 8 is
+ * the internal temperature sensor. Channel 15 is Gnd. If appropriate, a read of channel
+ * 15 can be used to zero the ADC sample and hold capacitor.
+ *
+ * If different types of sensor are used or the I2C is needed, there
+ * will need to be changes here.
+ */
+template <class T>
+void adc_isr(T &adc) {
+  PROFILE_SECTION(adc.m_step <= adc.m_dark_steps ? PROF_ADC_DARK : PROF_ADC_LIT);
+  uint8_t step = adc.m_step;
+  if (step == 0) {
+    adc.m_last_step = adc.m_emitters_enabled ? adc.m_total_steps : adc.m_dark_steps;
+  } else {
+    const auto &done = adc.m_sequence[step - 1];
+    if (done.action & (adc.STEP_STORE | adc.STEP_SUBTRACT)) {
+      uint8_t channel = done.channel;
+      uint16_t sum = adc.get_adc_result();
+      if (not T::HARDWARE_ACCUMULATION && adc.m_oversample[channel] > 0) {
+        sum += adc.m_sum;
+        if (++adc.m_sample < (1 << adc.m_oversample[channel])) {
+          adc.m_sum = sum;
+          adc.start_conversion(channel);
+          return;
+        }
+        adc.m_sum = 0;
+        adc.m_sample = 0;
+      }
+      int result = sum >> adc.m_result_shift[channel];
+      if (done.action & adc.STEP_STORE) {
+        adc.m_adc_reading[channel] = result;
+      } else {
+        adc.m_adc_reading[channel] = result - adc.m_adc_reading[channel];
+      }
+    }
+    if (done.action & adc.STEP_EMITTER_OFF) {
+      adc.emitter_off(done.pin);
+    }
+  }
+  if (step >= adc.m_last_step) {
+    PROFILE_SAMPLE_TAKEN();
+    adc.end_conversion_cycle();
+    uint16_t cycle_time = micros() - adc.m_cycle_start;
+    if (cycle_time > adc.m_cycle_time_max) {
+      adc.m_cycle_time_max = cycle_time;
+    }
+    return;
+  }
+  const auto &next = adc.m_sequence[step];
+  if (next.action & adc.STEP_EMITTER_ON) {
+    adc.emitter_on(next.pin);
+  }
+  if (next.action & (adc.STEP_STORE | adc.STEP_SUBTRACT)) {
+    adc.start_conversion(next.channel, adc.m_oversample[next.channel]);
+  } else {
+    adc.start_conversion(next.channel);
+  }
+  adc.m_step = step + 1;
+}
+
+#endif
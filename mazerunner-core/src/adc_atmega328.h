@@ -21,18 +21,22 @@
 #include <Arduino.h>
 #include <wiring_private.h>
 
-class adc_atmega328 : public IAnalogueConverter {
+class adc_atmega328 : public AnalogueConverter<adc_atmega328> {
 
 public:
+  // oversampling is done by repeated conversions in the ISR
+  static const bool HARDWARE_ACCUMULATION = false;
+
   adc_atmega328() = default;
 
-  void begin() override {
+  void begin() {
     disable_emitters();
     for (int i = 0; i < MAX_GROUPS; i++) {
       if (m_emitter_pin[i] < 255) {
         pinMode(m_emitter_pin[i], OUTPUT);
       }
     }
+    build_sequence();
     converter_init();
     m_configured = true;
   }
@@ -50,29 +54,32 @@ public:
    *  at these speeds:
    *  http://www.openmusiclabs.com/learning/digital/atmega-m_adc_reading/
    *
+   *  For faster sensor cycles, a prescaler of 16 gives a 1MHz clock and
+   *  conversions in around 13us at the cost of some more noise.
    */
   void converter_init() {
-    // Change the clock prescaler from 128 to 32 for a 500kHz clock
+    // Change the clock prescaler from 128 to 32, or 16, for a 500kHz or 1MHz clock
     bitSet(ADCSRA, ADPS2);
     bitClear(ADCSRA, ADPS1);
-    bitSet(ADCSRA, ADPS0);
+    bitWrite(ADCSRA, ADPS0, m_clock_divider == 32);
     // Set the reference to AVcc and right adjust the result
     ADMUX = DEFAULT << 6;
   }
-  void start_conversion_cycle() override {
+  void start_conversion_cycle() {
     if (not m_configured) {
       return;
     }
     bitSet(ADCSRA, ADIE); // enable the ADC interrupt
-    m_phase = 0;          // sync up the start of the sensor sequence
+    m_step = 0;           // sync up the start of the sensor sequence
+    m_cycle_start = micros();
     start_conversion(15); // begin a dummy conversion to get things started
   }
 
-  void end_conversion_cycle() override {
+  void end_conversion_cycle() {
     bitClear(ADCSRA, ADIE); // disable the ADC interrupt
   }
 
-  void start_conversion(uint8_t channel) override {
+  void start_conversion(uint8_t channel, uint8_t oversample = 0) {
 
     // select the channel
     ADMUX = (ADMUX & 0xF0) | (channel & 0x0F);
@@ -80,20 +87,20 @@ public:
     sbi(ADCSRA, ADSC);
   }
 
-  int get_adc_result() override {
+  int get_adc_result() {
     return ADC;
   }
   // END OF HARDWARE DEPENDENCY
   //***************************************************************************//
 
-  void emitter_on(uint8_t pin) override {
+  void emitter_on(uint8_t pin) {
     if (pin == 255 || not m_emitters_enabled) {
       return;
     }
     digitalWriteFast(pin, 1);
   }
 
-  void emitter_off(uint8_t pin) override {
+  void emitter_off(uint8_t pin) {
     if (pin == 255) {
       return;
     }
@@ -21,13 +21,17 @@
 #include <Arduino.h>
 #include <wiring_private.h>
 
-class adc_atmega4809 : public IAnalogueConverter {
+class adc_atmega4809 : public AnalogueConverter<adc_atmega4809> {
 
 public:
+  // the ADC can add up 2^n results by itself
+  static const bool HARDWARE_ACCUMULATION = true;
+
   adc_atmega4809() = default;
 
-  void begin() override {
+  void begin() {
     disable_emitters();
+    build_sequence();
     converter_init();
     m_configured = true;
   }
@@ -53,38 +57,41 @@ public:
     ADC0.CTRLC &= ~ADC_REFSEL_gm;                     // clear the reference selection
     ADC0.CTRLC |= ADC_REFSEL_VDDREF_gc;               // use VDD for the reference
     ADC0.CTRLC &= ~ADC_PRESC_gm;                      // Clear the prescaler bits
-    ADC0.CTRLC |= ADC_PRESC_DIV32_gc;                 // Prescaler DIV 32 => 500kHz?
+    ADC0.CTRLC |= m_clock_divider == 16 ? ADC_PRESC_DIV16_gc : ADC_PRESC_DIV32_gc; // 1MHz or 500kHz
     ADC0.CTRLD = 0;                                   // no sample delays or variations
     ADC0.CTRLE = 0;                                   // No window comparator
     ADC0.SAMPCTRL = 0;                                // Do not extend the ADC sampling length
     ADC0.INTCTRL |= ADC_RESRDY_bm;                    // Enable interrupts Gobal interrupt enable must be on
   }
 
-  void start_conversion_cycle() override {
+  void start_conversion_cycle() {
     if (not m_configured) {
       return;
     }
     ADC0.INTCTRL |= ADC_RESRDY_bm; /* Enable interrupts */
-    m_phase = 0;                   // sync up the start of the sensor sequence
+    m_step = 0;                    // sync up the start of the sensor sequence
+    m_cycle_start = micros();
     start_conversion(15);          // begin a dummy conversion to get things started
   }
 
-  void end_conversion_cycle() override {
+  void end_conversion_cycle() {
     ADC0.INTCTRL &= ~ADC_RESRDY_bm; /* Disable interrupts */
   }
 
-  void start_conversion(uint8_t channel) override {
+  void start_conversion(uint8_t channel, uint8_t oversample = 0) {
     // the 4809 maps internal channels differently    {3,2,1,0,12,13,4,5}
     channel = digitalPinToAnalogInput(channel);
     // select the channel - fix to channels 0-7
     ADC0.MUXPOS = channel & 0x0F; //
+    // accumulate 2^oversample results. SAMPNUM uses the same encoding
+    ADC0.CTRLB = oversample & ADC_SAMPNUM_gm;
     // start the conversion
     ADC0.INTCTRL = ADC_RESRDY_bm; // Enable ADC result ready interrupt TODO: should this be in init?
     ADC0.INTFLAGS = 0xFF;         // Clear interrupt flags
     ADC0.COMMAND = ADC_STCONV_bm; // start the conversion (cleared on completion)
   }
 
-  int get_adc_result() override {
+  int get_adc_result() {
     ADC0.INTFLAGS = ADC_RESRDY_bm;
     // Check that compiler gets low byte then high byte
     return ADC0.RES; // also clears the result ready interrupt flag.
@@ -92,14 +99,14 @@ public:
   // END OF HARDWARE DEPENDENCY
   //***************************************************************************//
 
-  void emitter_on(uint8_t pin) override {
+  void emitter_on(uint8_t pin) {
     if (pin == 255 || not m_emitters_enabled) {
       return;
     }
     digitalWriteFast(pin, 1);
   }
 
-  void emitter_off(uint8_t pin) override {
+  void emitter_off(uint8_t pin) {
     if (pin == 255) {
       return;
     }
@@ -23,18 +23,22 @@
  * to be implemented in an actual harware adc driver.
  *
  */
-class adc_null : public IAnalogueConverter {
+class adc_null : public AnalogueConverter<adc_null> {
 
 public:
+  // oversampling is done by repeated conversions in the ISR
+  static const bool HARDWARE_ACCUMULATION = false;
+
   adc_null() = default;
 
-  void begin() override {
+  void begin() {
     disable_emitters();
     for (int i = 0; i < MAX_GROUPS; i++) {
       if (m_emitter_pin[i] < 255) {
         pinMode(m_emitter_pin[i], OUTPUT);
       }
     }
+    build_sequence();
     converter_init();
     m_configured = true;
   }
@@ -56,38 +60,38 @@ public:
   void converter_init() {
   }
 
-  void start_conversion_cycle() override {
+  void start_conversion_cycle() {
     if (not m_configured) {
       return;
     }
     // enable the ADC interrupt
-    m_phase = 0; // sync up the start of the sensor sequence
+    m_step = 0; // sync up the start of the sensor sequence
     // start_conversion(15); // begin a dummy conversion to get things started
   }
 
-  void end_conversion_cycle() override {
+  void end_conversion_cycle() {
     // disable the ADC interrupt
   }
 
-  void start_conversion(uint8_t channel) override {
+  void start_conversion(uint8_t channel, uint8_t oversample = 0) {
 
     // select the channel
     // start the conversion
   }
-  int get_adc_result() override {
+  int get_adc_result() {
     return 0;
   }
   // END OF HARDWARE DEPENDENCY
   //***************************************************************************//
 
-  void emitter_on(uint8_t pin) override {
+  void emitter_on(uint8_t pin) {
     if (pin == 255 || not m_emitters_enabled) {
       return;
     }
     // digitalWriteFast(pin, 1);
   }
 
-  void emitter_off(uint8_t pin) override {
+  void emitter_off(uint8_t pin) {
     if (pin == 255) {
       return;
     }
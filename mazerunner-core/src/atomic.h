@@ -14,9 +14,20 @@
  *     https://opensource.org/licenses/MIT.                                   *
  ******************************************************************************/
 
+#pragma once
+
 #if defined(ARDUINO_ARCH_MEGAAVR) || defined(ARDUINO_ARCH_AVR)
 #include <util/atomic.h>
 #endif
 #ifdef ARDUINO_ARCH_NRF52840
 #define ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 #endif
+
+/***
+ * Stops the compiler moving memory accesses from one side to the other.
+ * Data shared with an interrupt without a lock must be written before the
+ * flag or index that says it is ready.
+ */
+inline void memory_barrier() {
+  asm volatile("" ::: "memory");
+}
@@ -19,6 +19,7 @@
 #include "../config.h"
 #include "atomic.h"
 #include "digitalWriteFast.h"
+#include "profiler.h"
 #include <Arduino.h>
 #include <stdint.h>
 
@@ -88,6 +89,7 @@ public:
   }
 
   void update() {
+    PROFILE_SECTION(PROF_ENCODERS);
     int left_delta = 0;
     int right_delta = 0;
     // Make sure values don't change while being read. Be quick.
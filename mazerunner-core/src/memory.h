@@ -0,0 +1,162 @@
+/******************************************************************************
+ * Project: mazerunner-core                                                   *
+ * File:    memory.h                                                          *
+ * File Created: Saturday, 17th October 2026 10:12:40 am                      *
+ * Author: Peter Harrison                                                     *
+ * -----                                                                      *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
+ * -----                                                                      *
+ * Copyright 2022 - 2026 Peter Harrison, Micromouseonline                     *
+ * -----                                                                      *
+ * Licence:                                                                   *
+ *     Use of this source code is governed by an MIT-style                    *
+ *     license that can be found in the LICENSE file or at                    *
+ *     https://opensource.org/licenses/MIT.                                   *
+ ******************************************************************************/
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include "atomic.h"
+#include <Arduino.h>
+
+/***
+ * The ATmega328 has only 2k of RAM. The static data sits at the bottom with
+ * the heap above it. The stack starts at the top and grows down towards the
+ * heap. Nothing stops the two meeting. When they do, the robot crashes in
+ * odd ways, usually half way through a run.
+ *
+ * To see how close they have come, the free RAM is painted with a known
+ * value right at the start of setup(). The stack overwrites the paint as it
+ * grows. Any paint that is left has never been used. Counting up from the
+ * heap to the first byte that is not paint gives the smallest gap there has
+ * ever been between the stack and the heap.
+ *
+ * Interrupts use the stack as well. A deep ISR on top of a deep call in the
+ * main code is what usually hits hardest. The high-water mark catches that
+ * as long as it has happened at least once since the reset.
+ *
+ * The linker symbols used here are provided by avr-libc. Other targets get
+ * zeros and available() returns false.
+ */
+
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+extern char __data_start; // start of RAM
+extern char __bss_end;    // end of the static data
+extern char __heap_start; // the heap starts here
+extern char *__brkval;    // the end of the heap. Zero if it has never been used
+#endif
+
+const uint8_t STACK_PAINT = 0xC5;
+
+class MemoryMonitor {
+public:
+  /***
+   * Call this as the very first thing in setup(). It paints from the top of
+   * the heap to just below the current stack. The gap leaves room for this
+   * function's own frame and for any interrupt that arrives while it runs.
+   */
+  void paint_stack() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    uint8_t *p = heap_end();
+    uint8_t *top = (uint8_t *)SP - 32;
+    while (p < top) {
+      *p++ = STACK_PAINT;
+    }
+#endif
+  }
+
+  bool available() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // all of the RAM
+  int total_ram() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return (int)(RAMEND + 1 - (uintptr_t)&__data_start);
+#else
+    return 0;
+#endif
+  }
+
+  // the .data, .bss and .noinit sections. All the global objects live here
+  int static_ram() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return (int)(&__heap_start - &__data_start);
+#else
+    return 0;
+#endif
+  }
+
+  // the .noinit section that sits between .bss and the heap. See PERSISTENT
+  int noinit_ram() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return (int)(&__heap_start - &__bss_end);
+#else
+    return 0;
+#endif
+  }
+
+  int heap_used() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return __brkval == 0 ? 0 : (int)(__brkval - &__heap_start);
+#else
+    return 0;
+#endif
+  }
+
+  // the gap between the heap and the stack right now
+  int free_ram() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return (int)((uint8_t *)SP - heap_end());
+#else
+    return 0;
+#endif
+  }
+
+  /***
+   * The deepest the stack has been since the reset. The paint is only
+   * checked from the current end of the heap so that a heap that has grown
+   * since does not look like stack.
+   */
+  int stack_used() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return (int)(RAMEND + 1 - (uintptr_t)lowest_stack());
+#else
+    return 0;
+#endif
+  }
+
+  // the smallest gap there has ever been between the stack and the heap
+  int stack_margin() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return (int)(lowest_stack() - heap_end());
+#else
+    return 0;
+#endif
+  }
+
+private:
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+  uint8_t *heap_end() {
+    return __brkval == 0 ? (uint8_t *)&__heap_start : (uint8_t *)__brkval;
+  }
+
+  uint8_t *lowest_stack() {
+    uint8_t *p = heap_end();
+    uint8_t *sp = (uint8_t *)SP;
+    while (p < sp && *p == STACK_PAINT) {
+      p++;
+    }
+    return p;
+  }
+#endif
+};
+
+extern MemoryMonitor memory;
+
+#endif
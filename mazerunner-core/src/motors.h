@@ -22,12 +22,21 @@
 #include "digitalWriteFast.h"
 #include "encoders.h"
 #include "profile.h"
+#include "profiler.h"
 // #include "sensors.h"
 
-enum { PWM_488_HZ,
-       PWM_977_HZ,
-       PWM_3906_HZ,
-       PWM_31250_HZ };
+/***
+ * Per-wheel feedforward. volts[i] is the voltage, above the bias, needed
+ * to keep the wheel turning at i * FF_SPEED_STEP mm/s.
+ */
+struct FeedForwardTable {
+  float bias;
+  float volts[FF_TABLE_SIZE];
+};
+
+enum { PWM_244_HZ,
+       PWM_1953_HZ,
+       PWM_15625_HZ };
 
 class Motors {
 public:
@@ -47,6 +56,12 @@ public:
     m_rot_error = 0;
     m_previous_fwd_error = 0;
     m_previous_rot_error = 0;
+    m_old_left_speed = 0;
+    m_old_right_speed = 0;
+    m_fwd_velocity = 0;
+    m_rot_velocity = 0;
+    m_fwd_integral = 0;
+    m_rot_integral = 0;
   }
 
   void stop() {
@@ -63,55 +78,165 @@ public:
     digitalWriteFast(MOTOR_LEFT_DIR, 0);
     digitalWriteFast(MOTOR_RIGHT_PWM, 0);
     digitalWriteFast(MOTOR_RIGHT_DIR, 0);
+    pwm_init();
     set_pwm_frequency();
+    load_feedforward_defaults();
     stop();
   }
 
+  /***
+   * Controller gains are scheduled by speed. The gain is interpolated from
+   * a table with entries at regular speed intervals. Beyond the end of the
+   * table, the last entry is used. The tables are in flash.
+   */
+  float scheduled_gain(const float *table, float speed, float one_over_step) {
+    float index = fabsf(speed) * one_over_step;
+    int i = (int)index;
+    if (i >= GAIN_TABLE_SIZE - 1) {
+      return pgm_read_float(&table[GAIN_TABLE_SIZE - 1]);
+    }
+    float lower = pgm_read_float(&table[i]);
+    float upper = pgm_read_float(&table[i + 1]);
+    return lower + (index - i) * (upper - lower);
+  }
+
+  /***
+   * The inner loop of the cascaded controllers. The demanded velocity is the
+   * profile speed plus a correction from the outer loop proportional to the
+   * position error. A PI controller drives the measured velocity to match.
+   *
+   * The integral is limited so that it cannot ask for more than the
+   * maximum motor voltage on its own. The limits are worked out in the
+   * config file so there is no divide here.
+   */
+  float velocity_controller(float speed, float position_error, float change, float &velocity, float &integral,
+                            float pos_kp, float vel_kp, float vel_ki, float integral_limit) {
+    float velocity_demand = speed + pos_kp * position_error;
+    velocity += LOOP_VELOCITY_FILTER * (change * LOOP_FREQUENCY - velocity);
+    float error = velocity_demand - velocity;
+    integral = constrain(integral + error * LOOP_INTERVAL, -integral_limit, integral_limit);
+    return vel_kp * error + vel_ki * integral;
+  }
+
   float position_controller() {
+    float speed = forward.speed();
     m_fwd_error += forward.increment() - encoders.robot_fwd_change();
+    if (CASCADED_CONTROL) {
+      return velocity_controller(speed, m_fwd_error, encoders.robot_fwd_change(), m_fwd_velocity, m_fwd_integral,
+                                 FWD_POS_KP, FWD_VEL_KP, FWD_VEL_KI, FWD_INTEGRAL_LIMIT);
+    }
+    float kp = scheduled_gain(FWD_KP_TABLE, speed, 1.0f / FWD_GAIN_SPEED_STEP);
+    float kd = scheduled_gain(FWD_KD_TABLE, speed, 1.0f / FWD_GAIN_SPEED_STEP) * DERIVATIVE_SCALE;
     float diff = m_fwd_error - m_previous_fwd_error;
     m_previous_fwd_error = m_fwd_error;
-    float output = FWD_KP * m_fwd_error + FWD_KD * diff;
+    float output = kp * m_fwd_error + kd * diff;
     return output;
   }
 
   float angle_controller(float steering_adjustment) {
+    float speed = rotation.speed();
     m_rot_error += rotation.increment() - encoders.robot_rot_change();
     m_rot_error += steering_adjustment;
+    if (CASCADED_CONTROL) {
+      return velocity_controller(speed, m_rot_error, encoders.robot_rot_change(), m_rot_velocity, m_rot_integral,
+                                 ROT_POS_KP, ROT_VEL_KP, ROT_VEL_KI, ROT_INTEGRAL_LIMIT);
+    }
+    float kp = scheduled_gain(ROT_KP_TABLE, speed, 1.0f / ROT_GAIN_SPEED_STEP);
+    float kd = scheduled_gain(ROT_KD_TABLE, speed, 1.0f / ROT_GAIN_SPEED_STEP) * DERIVATIVE_SCALE;
     float diff = m_rot_error - m_previous_rot_error;
     m_previous_rot_error = m_rot_error;
-    float output = ROT_KP * m_rot_error + ROT_KD * diff;
+    float output = kp * m_rot_error + kd * diff;
     return output;
   }
 
-  /** calculate the voltage to be applied to the motor for a given speed
-   *  the drive train is not symmetric and there is significant stiction.
-   *  If used with PID, a simpler, single value will be sufficient.
+  /***
+   * Load the default feedforward tables from the robot config file. The
+   * tables are kept in RAM so that they can be replaced after the motors
+   * have been characterised.
+   */
+  void load_feedforward_defaults() {
+    memcpy_P(m_left_ff.volts, LEFT_FF_TABLE, sizeof(m_left_ff.volts));
+    memcpy_P(m_right_ff.volts, RIGHT_FF_TABLE, sizeof(m_right_ff.volts));
+    m_left_ff.bias = LEFT_BIAS_FF;
+    m_right_ff.bias = RIGHT_BIAS_FF;
+  }
+
+  FeedForwardTable &left_feedforward() { return m_left_ff; }
+  FeedForwardTable &right_feedforward() { return m_right_ff; }
+
+  /***
+   * Build a feedforward table from a set of measured (volts, speed) pairs.
+   * The pairs must be in order of increasing voltage and the first should
+   * be the bias voltage with a speed of zero.
    *
-   *  Multiply by (1/x) is generally more efficient than just divide by x
+   * The voltage for each table speed is interpolated from the measurements.
+   * Only call this with the controllers disabled.
+   */
+  void fit_feedforward(FeedForwardTable &ff, const float *volts, const float *speeds, int count, float bias) {
+    ff.bias = bias;
+    ff.volts[0] = 0;
+    for (int i = 1; i < FF_TABLE_SIZE; i++) {
+      float speed = i * FF_SPEED_STEP;
+      int k = 1;
+      while (k < count - 1 && speeds[k] < speed) {
+        k++;
+      }
+      float v = volts[k - 1];
+      float ds = speeds[k] - speeds[k - 1];
+      if (ds > 0) {
+        v += (speed - speeds[k - 1]) * (volts[k] - volts[k - 1]) / ds;
+      }
+      ff.volts[i] = max(0.0f, v - bias);
+    }
+  }
+
+  /***
+   * Look up the voltage needed to keep a wheel turning at the given speed.
+   *
+   * The bias is only added if the wheel is supposed to be moving and it
+   * has the same sign as the speed. Beyond the end of the table, the last
+   * two entries are used to extrapolate.
+   *
+   * Multiply by (1/x) is generally more efficient than just divide by x
+   */
+  float feedforward_volts(const FeedForwardTable &ff, float speed) {
+    if (speed == 0) {
+      return 0;
+    }
+    float index = fabsf(speed) * (1.0f / FF_SPEED_STEP);
+    int i = (int)index;
+    if (i > FF_TABLE_SIZE - 2) {
+      i = FF_TABLE_SIZE - 2;
+    }
+    float volts = ff.bias + ff.volts[i] + (index - i) * (ff.volts[i + 1] - ff.volts[i]);
+    return speed < 0 ? -volts : volts;
+  }
+
+  /** calculate the voltage to be applied to the motor for a given speed
+   *  the drive train is not symmetric and there is significant stiction
+   *  so each wheel has its own table and previous speed.
    */
 
   float leftFeedForward(float speed) {
-    static float oldSpeed = 0;
-    float leftFF = speed * SPEED_FF + BIAS_FF;
-    float acc = (speed - oldSpeed) * LOOP_FREQUENCY;
-    oldSpeed = speed;
+    float leftFF = feedforward_volts(m_left_ff, speed);
+    float acc = (speed - m_old_left_speed) * LOOP_FREQUENCY;
+    m_old_left_speed = speed;
     float accFF = ACC_FF * acc;
     leftFF += accFF;
     return leftFF;
   }
 
   float rightFeedForward(float speed) {
-    static float oldSpeed = 0;
-    float rightFF = speed * SPEED_FF + BIAS_FF;
-    float acc = (speed - oldSpeed) * LOOP_FREQUENCY;
-    oldSpeed = speed;
+    float rightFF = feedforward_volts(m_right_ff, speed);
+    float acc = (speed - m_old_right_speed) * LOOP_FREQUENCY;
+    m_old_right_speed = speed;
     float accFF = ACC_FF * acc;
     rightFF += accFF;
     return rightFF;
   }
 
   void update_controllers(float steering_adjustment) {
+    PROFILE_SECTION(PROF_CONTROLLERS);
     float pos_output = position_controller();
     float rot_output = angle_controller(steering_adjustment);
     float left_output = 0;
@@ -134,7 +259,16 @@ public:
     }
   }
 
-  void set_battery_compensation(float comp) {
+  float get_fwd_error() {
+    return m_fwd_error;
+  }
+
+  float get_rot_error() {
+    return m_rot_error;
+  }
+
+  // comp is the fixed-point value from Sensors::update_battery_voltage()
+  void set_battery_compensation(uint16_t comp) {
     m_battery_compensation = comp;
   }
 
@@ -165,74 +299,133 @@ public:
   void set_left_motor_volts(float volts) {
     volts = constrain(volts, -MAX_MOTOR_VOLTS, MAX_MOTOR_VOLTS);
     m_left_motor_volts = volts;
-    int motorPWM = (int)(volts * m_battery_compensation);
+    int32_t millivolts = (int32_t)(volts * 1000);
+    int motorPWM = (int)((millivolts * m_battery_compensation) >> 16);
     set_left_motor_pwm(motorPWM);
   }
 
   void set_right_motor_volts(float volts) {
     volts = constrain(volts, -MAX_MOTOR_VOLTS, MAX_MOTOR_VOLTS);
     m_right_motor_volts = volts;
-    int motorPWM = (int)(volts * m_battery_compensation);
+    int32_t millivolts = (int32_t)(volts * 1000);
+    int motorPWM = (int)((millivolts * m_battery_compensation) >> 16);
     set_right_motor_pwm(motorPWM);
   }
 
   /***
-   * PWM values are constrained to +/- 255 since the default for
-   * analogueWrite is 8 bits. The sign is only used to determine
-   * the direction.
+   * PWM values are constrained to +/- MOTOR_MAX_PWM. The sign is only
+   * used to determine the direction.
    *
-   * NOTE: it might be wise to check the resolution of the
-   * analogueWrite function in other targtes
+   * These run in the systick ISR so, on the AVR targets, the duty cycle
+   * is written straight to the timer compare register rather than going
+   * through analogWrite() with its pin-to-timer lookups every call.
+   * Other targets fall back to analogWrite() with 8 bit resolution.
    */
   void set_left_motor_pwm(int pwm) {
-    pwm = MOTOR_LEFT_POLARITY * constrain(pwm, -255, 255);
+    pwm = MOTOR_LEFT_POLARITY * constrain(pwm, -MOTOR_MAX_PWM, MOTOR_MAX_PWM);
     if (pwm < 0) {
       digitalWriteFast(MOTOR_LEFT_DIR, 1);
-      analogWrite(MOTOR_LEFT_PWM, -pwm);
+      write_left_pwm(-pwm);
     } else {
       digitalWriteFast(MOTOR_LEFT_DIR, 0);
-      analogWrite(MOTOR_LEFT_PWM, pwm);
+      write_left_pwm(pwm);
     }
   }
 
   void set_right_motor_pwm(int pwm) {
-    pwm = MOTOR_RIGHT_POLARITY * constrain(pwm, -255, 255);
+    pwm = MOTOR_RIGHT_POLARITY * constrain(pwm, -MOTOR_MAX_PWM, MOTOR_MAX_PWM);
     if (pwm < 0) {
       digitalWriteFast(MOTOR_RIGHT_DIR, 1);
-      analogWrite(MOTOR_RIGHT_PWM, -pwm);
+      write_right_pwm(-pwm);
     } else {
       digitalWriteFast(MOTOR_RIGHT_DIR, 0);
-      analogWrite(MOTOR_RIGHT_PWM, pwm);
+      write_right_pwm(pwm);
     }
   }
 
-  void set_pwm_frequency(int frequency = PWM_31250_HZ) {
+  //***************************************************************************//
+  // START OF HARDWARE DEPENDENCY
+
+  /***
+   * The register level PWM driver assumes the UKMARSBOT pinout where
+   * the motor PWM pins are Arduino pins 9 and 10.
+   *
+   * ATmega328: Pins 9 and 10 are OC1A and OC1B. Timer 1 is set up for
+   * 10 bit fast PWM so the duty cycle is 0..1023.
+   *
+   * ATmega4809: Pins 9 and 10 are WO0 and WO1 of TCA0. The Arduino core
+   * runs TCA0 in split mode and its clock is shared with the TCB timers used
+   * for millis() and the systick so the prescaler and mode are left alone.
+   * The PWM is 8 bits at 977Hz but the compare registers are still written
+   * directly.
+   */
+  void pwm_init() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    static_assert(MOTOR_LEFT_PWM == 9 && MOTOR_RIGHT_PWM == 10, "direct PWM needs the motors on pins 9 and 10");
+#endif
+#if defined(ARDUINO_ARCH_AVR)
+    // non-inverting outputs on OC1A and OC1B, Fast PWM, 10 bit (mode 7)
+    TCCR1A = _BV(COM1A1) | _BV(COM1B1) | _BV(WGM11) | _BV(WGM10);
+    TCCR1B = (TCCR1B & 0x07) | _BV(WGM12);
+    OCR1A = 0;
+    OCR1B = 0;
+#elif defined(ARDUINO_ARCH_MEGAAVR)
+    TCA0.SPLIT.LCMP0 = 0;
+    TCA0.SPLIT.LCMP1 = 0;
+    TCA0.SPLIT.CTRLB |= TCA_SPLIT_LCMP0EN_bm | TCA_SPLIT_LCMP1EN_bm;
+#endif
+  }
+
+  inline void write_left_pwm(int duty) {
+#if defined(ARDUINO_ARCH_AVR)
+    OCR1A = duty;
+#elif defined(ARDUINO_ARCH_MEGAAVR)
+    TCA0.SPLIT.LCMP0 = duty;
+#else
+    analogWrite(MOTOR_LEFT_PWM, duty);
+#endif
+  }
+
+  inline void write_right_pwm(int duty) {
+#if defined(ARDUINO_ARCH_AVR)
+    OCR1B = duty;
+#elif defined(ARDUINO_ARCH_MEGAAVR)
+    TCA0.SPLIT.LCMP1 = duty;
+#else
+    analogWrite(MOTOR_RIGHT_PWM, duty);
+#endif
+  }
+
+  void set_pwm_frequency(int frequency = PWM_15625_HZ) {
 #if defined(ARDUINO_ARCH_AVR)
+    // Timer 1 is in 10 bit fast PWM mode so frequency = 16MHz / 1024 / prescaler
     switch (frequency) {
-      case PWM_31250_HZ:
-        // Divide by 1. frequency = 31.25 kHz;
+      case PWM_15625_HZ:
+        // Divide by 1. frequency = 15.6 kHz;
         bitClear(TCCR1B, CS11);
         bitSet(TCCR1B, CS10);
         break;
-      case PWM_3906_HZ:
-        // Divide by 8. frequency = 3.91 kHz;
+      case PWM_1953_HZ:
+        // Divide by 8. frequency = 1.95 kHz;
         bitSet(TCCR1B, CS11);
         bitClear(TCCR1B, CS10);
         break;
-      case PWM_488_HZ:
+      case PWM_244_HZ:
       default:
-        // Divide by 64. frequency = 488Hz;
+        // Divide by 64. frequency = 244Hz;
         bitSet(TCCR1B, CS11);
         bitSet(TCCR1B, CS10);
         break;
     }
 #elif defined(ARDUINO_ARCH_MEGAAVR)
-    // TCA0 is used for analogWrite on pins 9 and 10
+    // TCA0 is used for PWM on pins 9 and 10
     // The clock for TCA0 is also used as the clock for TCBx
     // so changing that screws up millis() and anythin else timed of TCBx
     // so just ignore a frequency change request and leave it at 977Hz
 #endif
   }
+  // END OF HARDWARE DEPENDENCY
+  //***************************************************************************//
 
 private:
   bool m_controller_output_enabled;
@@ -241,7 +434,16 @@ private:
   float m_previous_rot_error;
   float m_fwd_error;
   float m_rot_error;
-  float m_battery_compensation = 1.0f;
+  // only used by the cascaded controllers
+  float m_fwd_velocity = 0;
+  float m_rot_velocity = 0;
+  float m_fwd_integral = 0;
+  float m_rot_integral = 0;
+  uint16_t m_battery_compensation = 0;
+  float m_old_left_speed = 0;
+  float m_old_right_speed = 0;
+  FeedForwardTable m_left_ff;
+  FeedForwardTable m_right_ff;
   // these are maintained only for logging
   float m_left_motor_volts;
   float m_right_motor_volts;
@@ -41,6 +41,7 @@ public:
       m_speed = 0;
       m_target_speed = 0;
       m_state = PS_IDLE;
+      m_acc_scale = 1.0f;
     }
   }
 
@@ -130,6 +131,25 @@ public:
     return acc;
   }
 
+  /***
+   * The acceleration scale is managed by the supervisor in systick. It
+   * only applies while the speed is increasing. Braking always uses the
+   * full acceleration so that the profile still finishes where it should.
+   */
+  float acceleration_scale() {
+    float scale;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      scale = m_acc_scale;
+    }
+    return scale;
+  }
+
+  void set_acceleration_scale(float scale) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_acc_scale = scale;
+    }
+  }
+
   void set_speed(float speed) {
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
       m_speed = speed;
@@ -156,6 +176,7 @@ public:
       return;
     }
     float delta_v = m_acceleration * LOOP_INTERVAL;
+    float scaled_delta_v = delta_v * m_acc_scale;
     float remaining = fabsf(m_final_position) - fabsf(m_position);
     if (m_state == PS_ACCELERATING) {
       if (remaining < get_braking_distance()) {
@@ -169,13 +190,13 @@ public:
     }
     // try to reach the target speed
     if (m_speed < m_target_speed) {
-      m_speed += delta_v;
+      m_speed += (m_speed >= 0) ? scaled_delta_v : delta_v;
       if (m_speed > m_target_speed) {
         m_speed = m_target_speed;
       }
     }
     if (m_speed > m_target_speed) {
-      m_speed -= delta_v;
+      m_speed -= (m_speed <= 0) ? scaled_delta_v : delta_v;
       if (m_speed < m_target_speed) {
         m_speed = m_target_speed;
       }
@@ -195,6 +216,7 @@ private:
   int8_t m_sign = 1;
   float m_acceleration = 0;
   float m_one_over_acc = 1;
+  float m_acc_scale = 1.0f;
   float m_target_speed = 0;
   float m_final_speed = 0;
   float m_final_position = 0;
@@ -0,0 +1,222 @@
+/******************************************************************************
+ * Project: mazerunner-core                                                   *
+ * File:    profiler.h                                                        *
+ * File Created: Saturday, 17th October 2026 10:12:40 am                      *
+ * Author: Peter Harrison                                                     *
+ * -----                                                                      *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
+ * -----                                                                      *
+ * Copyright 2022 - 2026 Peter Harrison, Micromouseonline                     *
+ * -----                                                                      *
+ * Licence:                                                                   *
+ *     Use of this source code is governed by an MIT-style                    *
+ *     license that can be found in the LICENSE file or at                    *
+ *     https://opensource.org/licenses/MIT.                                   *
+ ******************************************************************************/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "atomic.h"
+#include "serial.h"
+#include <Arduino.h>
+
+/***
+ * A section profiler for finding out where the time goes.
+ *
+ * Put PROFILE_SECTION(id) at the start of a block and the time from there to
+ * the end of the block is added to the histogram for that section. The
+ * sections are listed in the enum below.
+ *
+ * The ADC ISR calls PROFILE_SAMPLE_TAKEN() when the last sensor sample of a
+ * cycle is in. PROFILE_SAMPLE_USED(id) records the time since then. Systick
+ * uses it just after the motor PWM has been written to get the latency from
+ * the sensor sample to the motor responding.
+ *
+ * Unless PROFILING is set below, the macros compile to nothing and the
+ * profiler takes no RAM or time at all. The switch lives here rather than in
+ * config.h because the ADC drivers use the profiler and config.h includes
+ * them. With it on, the profiler needs about 350 bytes of RAM and adds a few
+ * microseconds to every profiled section.
+ *
+ * Times come from micros(). Timer 1 is busy with the motor PWM so there is no
+ * free-running cycle counter. The resolution is 4us, or 64 cycles at 16MHz.
+ * That is good enough to see which sections matter. Each histogram bucket is
+ * twice as wide as the one before. Bucket 0 is under 4us, bucket 1 is 4-7us,
+ * bucket 2 is 8-15us and so on. The last bucket takes everything longer.
+ *
+ * The profiled times include some of the profiler's own overhead of a few
+ * microseconds per section.
+ */
+
+#define PROFILING 0
+
+enum {
+  PROF_SYSTICK,
+  PROF_ENCODERS,
+  PROF_FORWARD,
+  PROF_ROTATION,
+  PROF_SENSORS,
+  PROF_CONTROLLERS,
+  PROF_ADC_DARK,
+  PROF_ADC_LIT,
+  PROF_FLOOD,
+  PROF_SAMPLE_TO_PWM,
+  PROF_SECTIONS,
+};
+
+#if PROFILING
+
+const uint8_t PROFILE_BUCKETS = 12;
+
+struct ProfileSection {
+  uint16_t count[PROFILE_BUCKETS];
+  uint32_t total;   // us
+  uint32_t longest; // us
+};
+
+class Profiler;
+extern Profiler profiler;
+
+class Profiler {
+public:
+  void record(uint8_t section, uint32_t start) {
+    uint32_t duration = micros() - start;
+    ProfileSection &s = m_section[section];
+    uint8_t bucket = 0;
+    for (uint32_t d = duration >> 2; d > 0 && bucket < PROFILE_BUCKETS - 1; d >>= 1) {
+      bucket++;
+    }
+    if (s.count[bucket] < 0xFFFF) {
+      s.count[bucket]++;
+    }
+    s.total += duration;
+    s.longest = max(s.longest, duration);
+  }
+
+  void sample_taken() {
+    m_sample_time = micros();
+  }
+
+  uint32_t sample_time() {
+    uint32_t t;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      t = m_sample_time;
+    }
+    return t;
+  }
+
+  void reset() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      memset(m_section, 0, sizeof(m_section));
+    }
+  }
+
+  /***
+   * Print a line for each section that has been seen. The columns are the
+   * number of samples, the average and longest times in us and then the
+   * counts in each histogram bucket.
+   */
+  void print() {
+    console.print(F("section        n   avg   max |"));
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+      print_column(b == 0 ? 0 : 2UL << b);
+    }
+    console.println(F(" us"));
+    for (int i = 0; i < PROF_SECTIONS; i++) {
+      ProfileSection s;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        s = m_section[i];
+      }
+      uint32_t n = 0;
+      for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        n += s.count[b];
+      }
+      if (n == 0) {
+        continue;
+      }
+      console.print(section_name(i));
+      print_column(n);
+      print_column(s.total / n);
+      print_column(s.longest);
+      console.print(F(" |"));
+      for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        print_column(s.count[b]);
+      }
+      console.println();
+    }
+  }
+
+private:
+  const __FlashStringHelper *section_name(uint8_t section) {
+    switch (section) {
+      case PROF_SYSTICK:
+        return F("systick   ");
+      case PROF_ENCODERS:
+        return F("encoders  ");
+      case PROF_FORWARD:
+        return F("forward   ");
+      case PROF_ROTATION:
+        return F("rotation  ");
+      case PROF_SENSORS:
+        return F("sensors   ");
+      case PROF_CONTROLLERS:
+        return F("control   ");
+      case PROF_ADC_DARK:
+        return F("adc dark  ");
+      case PROF_ADC_LIT:
+        return F("adc lit   ");
+      case PROF_FLOOD:
+        return F("flood     ");
+      case PROF_SAMPLE_TO_PWM:
+        return F("sample>pwm");
+      default:
+        return F("?         ");
+    }
+  }
+
+  // print_justified() only copes with int so it is no good for the totals
+  void print_column(uint32_t value) {
+    int digits = 1;
+    for (uint32_t v = value; v >= 10; v /= 10) {
+      digits++;
+    }
+    for (int i = digits; i < 6; i++) {
+      console.print(' ');
+    }
+    console.print(value);
+  }
+
+  ProfileSection m_section[PROF_SECTIONS];
+  volatile uint32_t m_sample_time = 0;
+};
+
+/***
+ * The time is taken when the scope object is created and recorded when it
+ * goes out of scope.
+ */
+class ProfileScope {
+public:
+  explicit ProfileScope(uint8_t section) : m_section(section), m_start(micros()) {}
+  ~ProfileScope() { profiler.record(m_section, m_start); }
+
+private:
+  uint8_t m_section;
+  uint32_t m_start;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SECTION(section) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(section)
+#define PROFILE_SAMPLE_TAKEN() profiler.sample_taken()
+#define PROFILE_SAMPLE_USED(section) profiler.record(section, profiler.sample_time())
+
+#else
+
+#define PROFILE_SECTION(section)
+#define PROFILE_SAMPLE_TAKEN()
+#define PROFILE_SAMPLE_USED(section)
+
+#endif
+
+#endif
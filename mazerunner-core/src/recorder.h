@@ -0,0 +1,311 @@
+/******************************************************************************
+ * Project: mazerunner-core                                                   *
+ * File:    recorder.h                                                        *
+ * File Created: Saturday, 17th October 2026 10:12:40 am                      *
+ * Author: Peter Harrison                                                     *
+ * -----                                                                      *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
+ * -----                                                                      *
+ * Copyright 2022 - 2026 Peter Harrison, Micromouseonline                     *
+ * -----                                                                      *
+ * Licence:                                                                   *
+ *     Use of this source code is governed by an MIT-style                    *
+ *     license that can be found in the LICENSE file or at                    *
+ *     https://opensource.org/licenses/MIT.                                   *
+ ******************************************************************************/
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "../config.h"
+#include "atomic.h"
+#include <Arduino.h>
+
+/***
+ * The flight recorder is a black box for the robot. Anything sent over the
+ * serial port during a run changes the timing of the run and a Bluetooth
+ * link can drop data anyway. Instead, systick writes a small sample of the
+ * control state into a circular buffer in RAM. It costs a few microseconds
+ * and no I/O at all. The buffer always holds the last RECORDER_SAMPLES
+ * samples.
+ *
+ * The recorder freezes when something interesting has happened:
+ *
+ *   - the code asks it to, with freeze()
+ *   - systick sees a crash. The controller error has grown too big
+ *   - the run comes to an end
+ *   - the processor was reset while it was recording
+ *
+ * Once frozen it keeps its contents until the next run starts. Use the CLI
+ * D command to dump it at leisure.
+ *
+ * The buffer is in the .noinit section, like the maze, so it survives a
+ * reset. If the robot resets itself during a run, perhaps because the
+ * battery voltage dipped, the samples up to the reset are still there.
+ * begin() checks the magic number to tell a real record from the random
+ * contents of RAM after power up.
+ *
+ * The samples are fixed point to keep them small. Each one is 16 bytes.
+ * The main code can add an event marker to the next sample with mark().
+ * The search code marks every decision that it logs.
+ *
+ * The recorder can also work like the single shot trigger on an
+ * oscilloscope. Choose a trigger with set_trigger():
+ *
+ *   - a wall sensor reading at or above a level
+ *   - a forward or rotation controller error at or above a level
+ *   - a named event, such as the start of a turn, from signal_event()
+ *
+ * and a post-trigger length. Recording carries on as normal until the
+ * trigger fires. After that, the recorder takes the post-trigger number of
+ * samples and freezes. The buffer then holds the window around the trigger.
+ * The samples before the trigger fill the rest of the buffer. Like the
+ * other settings, the trigger survives a reset.
+ */
+
+struct FlightSample {
+  uint16_t tick;             // the low 16 bits of the snapshot tick count
+  int16_t fwd_speed;         // mm/s
+  int16_t rot_speed;         // deg/s
+  int16_t fwd_error;         // 0.01 mm
+  int16_t rot_error;         // 0.01 deg
+  int16_t fwd_millivolts;    //
+  int16_t rot_millivolts;    //
+  int8_t cross_track_error;  // limited to +/-127
+  char event;                // from mark(). Zero if there is none
+};
+
+enum RecorderState : uint8_t {
+  RECORDER_IDLE = 0,
+  RECORDER_RECORDING,
+  RECORDER_FROZEN,
+};
+
+enum RecorderReason : uint8_t {
+  FREEZE_NONE = 0,
+  FREEZE_COMMAND,
+  FREEZE_CRASH,
+  FREEZE_RUN_END,
+  FREEZE_RESET,
+  FREEZE_TRIGGER,
+};
+
+enum TriggerSource : uint8_t {
+  TRIGGER_OFF = 0,
+  TRIGGER_LFS,
+  TRIGGER_LSS,
+  TRIGGER_RSS,
+  TRIGGER_RFS,
+  TRIGGER_FWD_ERROR,
+  TRIGGER_ROT_ERROR,
+  TRIGGER_EVENT,
+};
+
+// named events for signal_event(). They are printed in the event column of the dump
+const char EVENT_TURN_START = '>';
+const char EVENT_WALL_STOP = '|';
+
+const uint16_t RECORDER_MAGIC = 0xB1AC;
+
+class FlightRecorder {
+public:
+  /***
+   * Call this in setup() before systick starts. There is no constructor
+   * because that would wipe the record from before the reset.
+   */
+  void begin() {
+    bool valid = m_magic == RECORDER_MAGIC && m_state <= RECORDER_FROZEN && m_count <= RECORDER_SAMPLES && m_next < RECORDER_SAMPLES;
+    valid = valid && m_trigger_source <= TRIGGER_EVENT && m_post_trigger < RECORDER_SAMPLES && m_decimation > 0;
+    if (not valid) {
+      clear();
+      set_trigger(TRIGGER_OFF, 0, 0);
+      m_decimation = RECORDER_DECIMATION;
+      return;
+    }
+    if (m_state == RECORDER_RECORDING) {
+      m_reason = FREEZE_RESET;
+      m_state = RECORDER_FROZEN;
+    }
+  }
+
+  // throw away the old record and start recording
+  void arm() {
+    clear();
+    memory_barrier();
+    m_state = RECORDER_RECORDING;
+  }
+
+  /***
+   * Stop recording and keep what is in the buffer. Only the first reason
+   * counts. Safe to call from systick or the main code.
+   */
+  void freeze(RecorderReason reason) {
+    if (m_state == RECORDER_RECORDING) {
+      m_reason = reason;
+      m_state = RECORDER_FROZEN;
+    }
+  }
+
+  // systick leaves the buffer alone once the state is idle
+  void clear() {
+    m_state = RECORDER_IDLE;
+    memory_barrier();
+    m_next = 0;
+    m_count = 0;
+    m_countdown = 0;
+    m_event = 0;
+    m_event_fired = false;
+    m_reason = FREEZE_NONE;
+    m_triggered = false;
+    m_after_trigger = 0;
+    m_magic = RECORDER_MAGIC;
+  }
+
+  /***
+   * Set these before the run starts. The level is in the units of the
+   * source. Wall sensors use the normalised value. Errors use hundredths of
+   * a mm or a degree, like the samples. Events use the event character.
+   * The post-trigger length is limited so that there is always at least one
+   * sample from before the trigger.
+   */
+  void set_trigger(TriggerSource source, int level, uint16_t post_trigger) {
+    m_trigger_source = source;
+    m_trigger_level = level;
+    m_post_trigger = min(post_trigger, (uint16_t)(RECORDER_SAMPLES - 1));
+  }
+
+  TriggerSource trigger_source() {
+    return m_trigger_source;
+  }
+
+  int trigger_level() {
+    return m_trigger_level;
+  }
+
+  uint16_t post_trigger() {
+    return m_post_trigger;
+  }
+
+  // take a sample every so many control ticks. 1 to 255
+  void set_decimation(uint8_t decimation) {
+    m_decimation = max(decimation, (uint8_t)1);
+  }
+
+  uint8_t decimation() {
+    return m_decimation;
+  }
+
+  bool recording() {
+    return m_state == RECORDER_RECORDING;
+  }
+
+  bool frozen() {
+    return m_state == RECORDER_FROZEN;
+  }
+
+  RecorderReason reason() {
+    return m_reason;
+  }
+
+  // tag the next sample. A later mark replaces one that has not been recorded.
+  void mark(char event) {
+    m_event = event;
+  }
+
+  /***
+   * A named event. It is marked like any other but it is also held as a
+   * flag of its own so that it can fire an event trigger even if a search
+   * decision mark replaces it before the next sample is taken.
+   */
+  void signal_event(char event) {
+    if (m_trigger_source == TRIGGER_EVENT && event == m_trigger_level) {
+      m_event_fired = true;
+    }
+    mark(event);
+  }
+
+  /***
+   * Called by systick once per control tick. Every m_decimation ticks it
+   * fills the next slot and moves on. Systick works out whether a sensor
+   * or error trigger has fired. The recorder checks for an event trigger
+   * itself.
+   */
+  bool sample_due() {
+    if (m_countdown > 0) {
+      m_countdown--;
+      return false;
+    }
+    m_countdown = m_decimation - 1;
+    return true;
+  }
+
+  FlightSample &next_sample() {
+    return m_samples[m_next];
+  }
+
+  void commit_sample(bool fired) {
+    char event = m_event;
+    m_event = 0;
+    bool event_fired = m_event_fired;
+    m_event_fired = false;
+    m_samples[m_next].event = event;
+    m_next = m_next + 1 < RECORDER_SAMPLES ? m_next + 1 : 0;
+    if (m_count < RECORDER_SAMPLES) {
+      m_count++;
+    }
+    if (m_triggered) {
+      m_after_trigger++;
+    } else if (m_trigger_source != TRIGGER_OFF) {
+      if (m_trigger_source == TRIGGER_EVENT) {
+        fired = event_fired;
+      }
+      m_triggered = fired;
+    }
+    if (m_triggered && m_after_trigger >= m_post_trigger) {
+      freeze(FREEZE_TRIGGER);
+    }
+  }
+
+  // only use these once the recorder has stopped
+  uint16_t count() {
+    return m_count;
+  }
+
+  // the number of the trigger sample or -1 if there was no trigger
+  int trigger_sample() {
+    if (not m_triggered) {
+      return -1;
+    }
+    return m_count - 1 - m_after_trigger;
+  }
+
+  // the oldest sample is number zero
+  const FlightSample &sample(uint16_t i) {
+    uint16_t index = m_next + RECORDER_SAMPLES - m_count + i;
+    if (index >= RECORDER_SAMPLES) {
+      index -= RECORDER_SAMPLES;
+    }
+    return m_samples[index];
+  }
+
+private:
+  FlightSample m_samples[RECORDER_SAMPLES];
+  uint16_t m_magic;
+  uint16_t m_next;
+  uint16_t m_count;
+  uint8_t m_countdown;
+  uint8_t m_decimation;
+  TriggerSource m_trigger_source;
+  int m_trigger_level;
+  uint16_t m_post_trigger;
+  uint16_t m_after_trigger;
+  bool m_triggered;
+  volatile char m_event;
+  volatile bool m_event_fired;
+  volatile RecorderState m_state;
+  volatile RecorderReason m_reason;
+};
+
+extern FlightRecorder recorder;
+
+#endif
@@ -0,0 +1,155 @@
+/******************************************************************************
+ * Project: mazerunner-core                                                   *
+ * File:    ring_buffer.h                                                     *
+ * File Created: Saturday, 17th October 2026 10:12:40 am                      *
+ * Author: Peter Harrison                                                     *
+ * -----                                                                      *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
+ * -----                                                                      *
+ * Copyright 2022 - 2026 Peter Harrison, Micromouseonline                     *
+ * -----                                                                      *
+ * Licence:                                                                   *
+ *     Use of this source code is governed by an MIT-style                    *
+ *     license that can be found in the LICENSE file or at                    *
+ *     https://opensource.org/licenses/MIT.                                   *
+ ******************************************************************************/
+
+#pragma once
+
+#include "atomic.h"
+#include <Arduino.h>
+
+/***
+ * A ring buffer for passing data from an interrupt to the main loop, or the
+ * other way round, without turning interrupts off.
+ *
+ * There must be only one producer and one consumer. The producer calls
+ * push() and the consumer calls pop(). Each side only ever writes its own
+ * index. The head belongs to the producer and the tail to the consumer.
+ * The indices are single bytes so every read and write of them is atomic,
+ * even on an 8 bit processor. An item is written before the head moves on,
+ * and read before the tail moves on. Each side also reads the other side's
+ * index before it touches the data. Memory barriers on both sides stop the
+ * compiler moving the data accesses across the index accesses. Thus neither
+ * side can ever see a half-written item.
+ *
+ * The size must be a power of two, no more than 128. The indices run freely
+ * and are only masked when the buffer is accessed. The number of items held
+ * is just head - tail. A full buffer can use every slot, with no empty slot
+ * needed to tell full from empty.
+ *
+ * Items that will not fit are dropped and counted. The producer must never
+ * wait for the consumer because an ISR that waits for the main loop will
+ * wait forever. A bulk push is all or nothing so that a frame of bytes is
+ * never cut short in the buffer.
+ */
+template <class item_t, uint8_t SIZE>
+class RingBuffer {
+  static_assert(SIZE >= 2 && SIZE <= 128 && (SIZE & (SIZE - 1)) == 0, "RingBuffer SIZE must be a power of two up to 128");
+
+public:
+  enum { MASK = SIZE - 1 };
+
+  // producer
+  bool push(const item_t &item) {
+    uint8_t head = m_head;
+    if ((uint8_t)(head - m_tail) >= SIZE) {
+      count_drops(1);
+      return false;
+    }
+    // the slot is free before it is written
+    memory_barrier();
+    m_data[head & MASK] = item;
+    memory_barrier();
+    m_head = head + 1;
+    return true;
+  }
+
+  // producer. Either all the items go in or none of them do.
+  bool push(const item_t *items, uint8_t count) {
+    uint8_t head = m_head;
+    if (count > SIZE - (uint8_t)(head - m_tail)) {
+      count_drops(count);
+      return false;
+    }
+    memory_barrier();
+    for (uint8_t i = 0; i < count; i++) {
+      m_data[(head + i) & MASK] = items[i];
+    }
+    memory_barrier();
+    m_head = head + count;
+    return true;
+  }
+
+  // consumer
+  bool pop(item_t &item) {
+    uint8_t tail = m_tail;
+    if (tail == m_head) {
+      return false;
+    }
+    // the item is complete before it is read
+    memory_barrier();
+    item = m_data[tail & MASK];
+    memory_barrier();
+    m_tail = tail + 1;
+    return true;
+  }
+
+  // consumer. Returns the number of items copied out.
+  uint8_t pop(item_t *items, uint8_t max_count) {
+    uint8_t tail = m_tail;
+    uint8_t count = min((uint8_t)(m_head - tail), max_count);
+    memory_barrier();
+    for (uint8_t i = 0; i < count; i++) {
+      items[i] = m_data[(tail + i) & MASK];
+    }
+    memory_barrier();
+    m_tail = tail + count;
+    return count;
+  }
+
+  // consumer. Throw away everything in the buffer.
+  void flush() {
+    m_tail = m_head;
+  }
+
+  uint8_t available() {
+    return m_head - m_tail;
+  }
+
+  uint8_t space() {
+    return SIZE - available();
+  }
+
+  bool empty() {
+    return m_head == m_tail;
+  }
+
+  bool full() {
+    return available() >= SIZE;
+  }
+
+  // the count is only written by the producer. Either side can read it.
+  uint16_t dropped() {
+    uint16_t drops;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      drops = m_dropped;
+    }
+    return drops;
+  }
+
+private:
+  // rare enough that the lock does not matter
+  void count_drops(uint8_t count) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      uint16_t drops = m_dropped + count;
+      // stick at the maximum rather than wrap back to a small number
+      m_dropped = drops < m_dropped ? 0xFFFF : drops;
+    }
+  }
+
+  item_t m_data[SIZE];
+  volatile uint8_t m_head = 0;
+  volatile uint8_t m_tail = 0;
+  volatile uint16_t m_dropped = 0;
+};
@@ -21,6 +21,7 @@
 #include "adc.h"
 #include "atomic.h"
 #include "digitalWriteFast.h"
+#include "profiler.h"
 #include <Arduino.h>
 #include <wiring_private.h>
 
@@ -38,10 +39,46 @@ const uint8_t RIGHT_START = 2;
 
 //***************************************************************************//
 struct SensorChannel {
-  int raw;   // whatever the ADC gives us
-  int value; // normalised to 100 at reference position
+  int raw;      // whatever the ADC gives us
+  int value;    // normalised to 100 at reference position
+  int distance; // mm from the robot centre to the wall
 };
 
+/***
+ * The cross-track error is in mm and is negative when the robot is too far
+ * left. Too far left puts the left wall closer than the reference distance
+ * and the right wall further away so both side errors are written as
+ * distance - reference. The left error is then negative and the right
+ * error positive.
+ */
+constexpr int left_side_error(int lss_distance) {
+  return lss_distance - SIDE_REFERENCE_DISTANCE;
+}
+
+constexpr int right_side_error(int rss_distance) {
+  return rss_distance - SIDE_REFERENCE_DISTANCE;
+}
+
+// with only one wall the error is doubled to give the same steering gain
+constexpr int side_wall_error(bool left_wall, bool right_wall, int left_error, int right_error) {
+  return left_wall && right_wall ? left_error - right_error
+         : left_wall             ? 2 * left_error
+         : right_wall            ? -2 * right_error
+                                 : 0;
+}
+
+// a robot 10mm left of centre must see a negative error and 10mm right a positive one
+constexpr int side_error_offset_by(int offset, bool left_wall, bool right_wall) {
+  return side_wall_error(left_wall, right_wall, left_side_error(SIDE_REFERENCE_DISTANCE + offset),
+                         right_side_error(SIDE_REFERENCE_DISTANCE - offset));
+}
+static_assert(side_error_offset_by(-10, true, true) < 0, "too far left with both walls must give a negative error");
+static_assert(side_error_offset_by(-10, true, false) < 0, "too far left with the left wall must give a negative error");
+static_assert(side_error_offset_by(-10, false, true) < 0, "too far left with the right wall must give a negative error");
+static_assert(side_error_offset_by(10, true, true) > 0, "too far right with both walls must give a positive error");
+static_assert(side_error_offset_by(10, true, false) > 0, "too far right with the left wall must give a positive error");
+static_assert(side_error_offset_by(10, false, true) > 0, "too far right with the right wall must give a positive error");
+
 class Sensors;
 extern Sensors sensors;
 
@@ -61,15 +98,19 @@ public:
 
   volatile int m_front_sum;
   volatile int m_front_diff;
+  volatile int m_front_distance;
 
   /*** steering variables ***/
   uint8_t g_steering_mode = STEER_NORMAL;
 
   int get_front_sum() { return int(m_front_sum); };
   int get_front_diff() { return int(m_front_diff); };
-  float get_steering_feedback() { return m_steering_adjustment; }
-  float get_cross_track_error() { return m_cross_track_error; };
-  float get_battery_comp() { return m_battery_compensation; };
+  int get_front_distance() { return int(m_front_distance); };
+  int get_left_distance() { return int(lss.distance); };
+  int get_right_distance() { return int(rss.distance); };
+  float get_steering_feedback() { return m_steering_adjustment * (1.0f / (1L << STEERING_SHIFT)); }
+  int get_cross_track_error() { return m_cross_track_error; };
+  uint16_t get_battery_comp() { return m_battery_compensation; };
 
   //***************************************************************************//
 
@@ -85,24 +126,47 @@ public:
    * The steering adjustment is limited to prevent over-correction. You should
    * experiment with that as well.
    *
+   * This runs in systick so it is all done in fixed-point. The gains already
+   * include LOOP_INTERVAL and the result has STEERING_SHIFT fractional bits.
+   *
    * @brief Calculate the steering adjustment from the cross-track error.
    * @param error calculated from wall sensors, Negative if too far right
-   * @return steering adjustment in degrees
+   * @return steering adjustment in degrees, fixed-point
    */
-  float calculate_steering_adjustment() {
+  long calculate_steering_adjustment() {
     // always calculate the adjustment for testing. It may not get used.
-    float pTerm = STEERING_KP * m_cross_track_error;
-    float dTerm = STEERING_KD * (m_cross_track_error - last_steering_error);
-    float adjustment = (pTerm + dTerm) * LOOP_INTERVAL;
+    long pTerm = STEERING_KP_FIXED * m_cross_track_error;
+    long dTerm = STEERING_KD_FIXED * (m_cross_track_error - m_last_steering_error);
+    long adjustment = pTerm + dTerm;
     // TODO: are these limits appropriate, or even needed?
-    adjustment = constrain(adjustment, -STEERING_ADJUST_LIMIT, STEERING_ADJUST_LIMIT);
-    last_steering_error = m_cross_track_error;
+    adjustment = constrain(adjustment, -STEERING_LIMIT_FIXED, STEERING_LIMIT_FIXED);
+    m_last_steering_error = m_cross_track_error;
     m_steering_adjustment = adjustment;
     return adjustment;
   }
 
+  /***
+   * The calibration values are the raw readings that should give the nominal
+   * normalised values. The config file has defaults but they normally come
+   * from a measured calibration. See calibration.h.
+   *
+   * The scale factors are fixed-point with SENSOR_SCALE_SHIFT fractional bits.
+   */
+  void set_calibration(int front_left, int front_right, int left, int right) {
+    m_front_left_scale = fixed_scale(FRONT_NOMINAL, front_left);
+    m_front_right_scale = fixed_scale(FRONT_NOMINAL, front_right);
+    m_left_scale = fixed_scale(SIDE_NOMINAL, left);
+    m_right_scale = fixed_scale(SIDE_NOMINAL, right);
+  }
+
+  static uint16_t fixed_scale(int nominal, int calibration) {
+    calibration = max(calibration, 1);
+    long scale = (((long)nominal << SENSOR_SCALE_SHIFT) + calibration / 2) / calibration;
+    return min(scale, 65535L);
+  }
+
   void set_steering_mode(uint8_t mode) {
-    last_steering_error = m_cross_track_error;
+    m_last_steering_error = m_cross_track_error;
     m_steering_adjustment = 0;
     g_steering_mode = mode;
   }
@@ -121,9 +185,65 @@ public:
 
   //***************************************************************************//
 
+  /***
+   * The battery ADC reading is noisy and the battery voltage changes slowly so
+   * there is no need to do the sums every tick. Systick calls this every
+   * BATTERY_TICKS and the reading goes through a simple integer low-pass
+   * filter before the voltage is calculated.
+   *
+   * The motor drive needs the reciprocal of the battery voltage. To save the
+   * motors doing any more float arithmetic than needed, the compensation is
+   * kept as a fixed-point value. It is the number of PWM counts per millivolt,
+   * scaled by 65536. Motor volts * 1000 * compensation >> 16 gives the PWM.
+   */
   void update_battery_voltage() {
-    m_battery_volts = BATTERY_MULTIPLIER * m_battery_adc;
-    m_battery_compensation = 255.0 / m_battery_volts;
+    m_battery_adc = adc[BATTERY_CHANNEL];
+    if (m_battery_filter == 0) {
+      m_battery_filter = m_battery_adc << BATTERY_FILTER_SHIFT;
+    }
+    m_battery_filter += m_battery_adc - (m_battery_filter >> BATTERY_FILTER_SHIFT);
+    float volts = (BATTERY_MULTIPLIER / (1 << BATTERY_FILTER_SHIFT)) * m_battery_filter;
+    m_battery_volts = volts;
+    // avoid overflow if there is no battery connected
+    float comp = (65536.0f * MOTOR_MAX_PWM / 1000.0f) / max(volts, 1.1f);
+    m_battery_compensation = (uint16_t)comp;
+  }
+
+  /***
+   * Convert a normalised reading into a distance in mm using one of the
+   * linearisation tables in the robot config. The entries are the readings
+   * at evenly spaced distances so the distance comes from interpolating
+   * between the two entries either side of the reading. Readings off either
+   * end of the table give the distance at that end.
+   */
+  static int value_to_distance(const int *table, int value) {
+    int upper = pgm_read_word(table);
+    if (value >= upper) {
+      return SENSOR_TABLE_START;
+    }
+    for (int i = 1; i < SENSOR_TABLE_SIZE; i++) {
+      int lower = pgm_read_word(table + i);
+      if (value >= lower) {
+        // upper > value >= lower so there is no division by zero
+        int distance = SENSOR_TABLE_START + (i - 1) * SENSOR_TABLE_STEP;
+        return distance + (SENSOR_TABLE_STEP * (upper - value)) / (upper - lower);
+      }
+      upper = lower;
+    }
+    return SENSOR_TABLE_START + (SENSOR_TABLE_SIZE - 1) * SENSOR_TABLE_STEP;
+  }
+
+  // the reverse of value_to_distance(). Used for calibration.
+  static int distance_to_value(const int *table, int distance) {
+    int i = constrain((distance - SENSOR_TABLE_START) / SENSOR_TABLE_STEP, 0, SENSOR_TABLE_SIZE - 2);
+    int offset = constrain(distance - (SENSOR_TABLE_START + i * SENSOR_TABLE_STEP), 0, SENSOR_TABLE_STEP);
+    int upper = pgm_read_word(table + i);
+    int lower = pgm_read_word(table + i + 1);
+    return upper - ((upper - lower) * offset) / SENSOR_TABLE_STEP;
+  }
+
+  static int scaled(int raw, uint16_t scale) {
+    return (int)(((long)raw * scale) >> SENSOR_SCALE_SHIFT);
   }
 
   /*********************************** Wall tracking **************************/
@@ -135,9 +255,7 @@ public:
    * @return robot cross-track-error. Too far left is negative.
    */
   void update() {
-    m_battery_adc = adc[BATTERY_CHANNEL];
-
-    update_battery_voltage();
+    PROFILE_SECTION(PROF_SENSORS);
     if (not m_enabled) {
       // NOTE: No values will be updated although the ADC is working
       m_cross_track_error = 0;
@@ -156,39 +274,40 @@ public:
     lfs.raw = max(0, adc[LFS_CHANNEL]);
 
     // normalise to a nominal value of 100
-    rfs.value = (int)(rfs.raw * FRONT_RIGHT_SCALE);
-    rss.value = (int)(rss.raw * RIGHT_SCALE);
-    lss.value = (int)(lss.raw * LEFT_SCALE);
-    lfs.value = (int)(lfs.raw * FRONT_LEFT_SCALE);
+    rfs.value = scaled(rfs.raw, m_front_right_scale);
+    rss.value = scaled(rss.raw, m_right_scale);
+    lss.value = scaled(lss.raw, m_left_scale);
+    lfs.value = scaled(lfs.raw, m_front_left_scale);
+
+    // and convert to real distances
+    rfs.distance = value_to_distance(RFS_TABLE, rfs.value);
+    rss.distance = value_to_distance(RSS_TABLE, rss.value);
+    lss.distance = value_to_distance(LSS_TABLE, lss.value);
+    lfs.distance = value_to_distance(LFS_TABLE, lfs.value);
 
     // set the wall detection flags
-    see_left_wall = lss.value > LEFT_THRESHOLD;
-    see_right_wall = rss.value > RIGHT_THRESHOLD;
+    see_left_wall = lss.distance < LEFT_WALL_DISTANCE;
+    see_right_wall = rss.distance < RIGHT_WALL_DISTANCE;
     m_front_sum = lfs.value + rfs.value;
     m_front_diff = lfs.value - rfs.value;
-    see_front_wall = m_front_sum > FRONT_THRESHOLD;
+    m_front_distance = (lfs.distance + rfs.distance) / 2;
+    see_front_wall = m_front_distance < FRONT_WALL_DISTANCE;
 
-    // calculate the alignment errors - too far left is negative
+    // calculate the alignment errors in mm - too far left is negative
     int error = 0;
-    int right_error = SIDE_NOMINAL - rss.value;
-    int left_error = SIDE_NOMINAL - lss.value;
+    int right_error = right_side_error(rss.distance);
+    int left_error = left_side_error(lss.distance);
     if (g_steering_mode == STEER_NORMAL) {
-      if (sensors.see_left_wall && sensors.see_right_wall) {
-        error = left_error - right_error;
-      } else if (sensors.see_left_wall) {
-        error = 2 * left_error;
-      } else if (sensors.see_right_wall) {
-        error = -2 * right_error;
-      }
+      error = side_wall_error(see_left_wall, see_right_wall, left_error, right_error);
     } else if (g_steering_mode == STEER_LEFT_WALL) {
-      error = 2 * left_error;
+      error = side_wall_error(true, false, left_error, right_error);
     } else if (g_steering_mode == STEER_RIGHT_WALL) {
-      error = -2 * right_error;
+      error = side_wall_error(false, true, left_error, right_error);
     }
 
     // the side sensors are not reliable close to a wall ahead.
-    // TODO: The magic number 100 may need adjusting
-    if (m_front_sum > 100) {
+    // TODO: The magic number 170 may need adjusting
+    if (m_front_distance < 170) {
       error = 0;
     }
     m_cross_track_error = error;
@@ -240,13 +359,19 @@ public:
   }
 
 private:
-  float last_steering_error = 0;
+  int m_last_steering_error = 0;
+  // the compiler works these out from the config calibrations
+  uint16_t m_front_left_scale = (uint16_t)(FRONT_LEFT_SCALE * (1 << SENSOR_SCALE_SHIFT) + 0.5f);
+  uint16_t m_front_right_scale = (uint16_t)(FRONT_RIGHT_SCALE * (1 << SENSOR_SCALE_SHIFT) + 0.5f);
+  uint16_t m_left_scale = (uint16_t)(LEFT_SCALE * (1 << SENSOR_SCALE_SHIFT) + 0.5f);
+  uint16_t m_right_scale = (uint16_t)(RIGHT_SCALE * (1 << SENSOR_SCALE_SHIFT) + 0.5f);
   volatile bool m_enabled = false;
   volatile int m_battery_adc;
+  uint16_t m_battery_filter = 0;
   volatile float m_battery_volts;
-  volatile float m_battery_compensation;
-  volatile float m_cross_track_error;
-  volatile float m_steering_adjustment;
+  volatile uint16_t m_battery_compensation;
+  volatile int m_cross_track_error;
+  volatile long m_steering_adjustment;
 };
 
 #endif
\ No newline at end of file
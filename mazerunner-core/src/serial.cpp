@@ -34,10 +34,13 @@
  * 
  * TODO: Probably better to make the decision in the board config file
  *
+ * The port is not used directly. The console is a SerialBuffered in front
+ * of it so that printing does not have to wait for the port. See
+ * serial_buffered.h.
  *
  */
 #if defined(ARDUINO_AVR_NANO) || defined(ARDUINO_AVR_NANO_EVERY)
-HardwareSerial &console = Serial;
+HardwareSerial &console_port = Serial;
 #elif defined(ARDUINO_AVR_LEONARDO)
 /***
  * On the Leonardo platform, Serial is a virtual com port and so
@@ -46,13 +49,15 @@ HardwareSerial &console = Serial;
  * Here we ensure that a 'proper' serial connection is made with the
  * Arduino TX and RX pins.
  */
-HardwareSerial &console = Serial1;
+HardwareSerial &console_port = Serial1;
 #elif defined(ARDUINO_ARDUINO_NANO33BLE)
-HardwareSerial &console = Serial1;
+HardwareSerial &console_port = Serial1;
 #else
 #error Unsupported hardware
 #endif
 
+SerialBuffered console(console_port);
+
 /***
  * The code also has a NULL serial device. You can use this exactly 
  * like any other serial device but all the calls immediately return 
@@ -16,10 +16,11 @@
 
 #pragma once
 
+#include "serial_buffered.h"
 #include "serial_null.h"
 #include <Arduino.h>
 
-extern HardwareSerial &console;
+extern SerialBuffered console;
 extern Stream &debug;
 
 extern void redirectPrintf();
@@ -0,0 +1,241 @@
+/******************************************************************************
+ * Project: mazerunner-core                                                   *
+ * File:    serial_buffered.h                                                 *
+ * File Created: Saturday, 17th October 2026 10:12:40 am                      *
+ * Author: Peter Harrison                                                     *
+ * -----                                                                      *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
+ * -----                                                                      *
+ * Copyright 2022 - 2026 Peter Harrison, Micromouseonline                     *
+ * -----                                                                      *
+ * Licence:                                                                   *
+ *     Use of this source code is governed by an MIT-style                    *
+ *     license that can be found in the LICENSE file or at                    *
+ *     https://opensource.org/licenses/MIT.                                   *
+ ******************************************************************************/
+#pragma once
+
+#include "ring_buffer.h"
+#include <Arduino.h>
+
+/***
+ * The size of the transmit ring in front of the hardware serial port. It
+ * adds to the 64 byte buffer that is already inside HardwareSerial. Keep it
+ * small on the ATmega328. The ring buffer allows up to 128.
+ *
+ * This is here rather than in config.h because the serial headers are
+ * included by files that config.h itself includes.
+ */
+#if defined(ARDUINO_ARCH_AVR)
+const uint8_t CONSOLE_TX_SIZE = 64;
+#else
+const uint8_t CONSOLE_TX_SIZE = 128;
+#endif
+
+/***
+ * HardwareSerial makes print() wait when its transmit buffer is full. At
+ * 115200 baud the 64 byte buffer takes more than 5ms to empty. A few log
+ * lines in the middle of a search can then hold up the next decision. The
+ * robot has moved on by the time the code gets to look at the walls.
+ *
+ * SerialBuffered sits in front of the real port. Everything written to it
+ * goes into a ring. Systick takes a few bytes from the ring each tick and
+ * passes them to the port, never more than the port can take at once. So
+ * neither side ever waits for the serial port.
+ *
+ * When the ring is full there are two choices:
+ *
+ *   - blocking, the default. write() waits for systick to make room. This
+ *     is what the CLI and the reports want. Nothing is lost.
+ *   - non-blocking, for code that must not be held up. Set it with
+ *     set_blocking(false) for the time-critical part. Anything that does
+ *     not fit is dropped and counted. The rest of that line is dropped
+ *     as well. When there is room again, a '~' and a line end go out
+ *     before the next line to show where text is missing.
+ *
+ * The ring is only used on the AVR targets and only once systick is
+ * running. Call start_tx_ring() after systick.begin(). Until then, and
+ * on the other targets, everything goes straight to the port as before.
+ *
+ * Binary data, such as the telemetry frames, must use write_raw(). The
+ * drop and marker logic is only for text. A '~' in the middle of a frame,
+ * or the rest of a frame thrown away because it had no line end, would
+ * break the stream.
+ *
+ * Systick is the only reader of the ring and the main code is the only
+ * writer. Do not print from an interrupt.
+ */
+class SerialBuffered : public Stream {
+public:
+  explicit SerialBuffered(HardwareSerial &port) : m_port(port) {
+  }
+
+  void begin(unsigned long baud) {
+    m_port.begin(baud);
+  }
+
+  void start_tx_ring() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    m_ring_on = true;
+#endif
+  }
+
+  // going back to blocking also ends any line that is being dropped
+  void set_blocking(bool blocking) {
+    m_blocking = blocking;
+    if (blocking) {
+      m_dropping = false;
+      m_marker_due = false;
+    }
+  }
+
+  bool blocking() {
+    return m_blocking;
+  }
+
+  // the bytes dropped in non-blocking mode since the reset
+  uint16_t dropped() {
+    return m_dropped;
+  }
+
+  /***
+   * Called by systick. It sends at most max_bytes so that the time spent in
+   * the interrupt stays short. Set that a little above the number of
+   * characters the port can send in one tick.
+   */
+  void pump(uint8_t max_bytes) {
+    if (not m_ring_on) {
+      return;
+    }
+    uint8_t count = min(m_port.availableForWrite(), (int)max_bytes);
+    uint8_t c;
+    while (count > 0 && m_ring.pop(c)) {
+      m_port.write(c);
+      count--;
+    }
+  }
+
+  size_t write(uint8_t c) override {
+    if (not m_ring_on) {
+      return m_port.write(c);
+    }
+    if (m_dropping) {
+      drop(c);
+      return 0;
+    }
+    // room for the marker as well if there is one waiting
+    uint8_t needed = m_marker_due ? 3 : 1;
+    if (m_blocking && can_wait()) {
+      while (m_ring.space() < needed) {
+        // systick is making room
+      }
+    }
+    if (m_ring.space() < needed) {
+      m_dropping = true;
+      drop(c);
+      return 0;
+    }
+    if (m_marker_due) {
+      m_ring.push('~');
+      m_ring.push('\n');
+      m_marker_due = false;
+    }
+    m_ring.push(c);
+    return 1;
+  }
+
+  // every byte is looked at so that a line end always ends a drop
+  size_t write(const uint8_t *buffer, size_t size) override {
+    size_t n = 0;
+    while (size--) {
+      n += write(*buffer++);
+    }
+    return n;
+  }
+
+  using Print::write;
+
+  /***
+   * For binary data. The bytes go out exactly as they are, with no drops
+   * and no markers. It waits for room in the ring whatever the blocking
+   * mode. Callers that must not wait should write no more than
+   * availableForWrite().
+   */
+  size_t write_raw(uint8_t c) {
+    if (not m_ring_on) {
+      return m_port.write(c);
+    }
+    if (can_wait()) {
+      while (m_ring.space() == 0) {
+        // systick is making room
+      }
+    }
+    return m_ring.push(c) ? 1 : 0;
+  }
+
+  size_t write_raw(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+      n += write_raw(*buffer++);
+    }
+    return n;
+  }
+
+  int availableForWrite() override {
+    if (not m_ring_on) {
+      return m_port.availableForWrite();
+    }
+    return m_ring.space();
+  }
+
+  // wait until everything has gone out of the port
+  void flush() override {
+    if (m_ring_on && can_wait()) {
+      while (not m_ring.empty()) {
+        // systick is sending it
+      }
+    }
+    m_port.flush();
+  }
+
+  int available() override {
+    return m_port.available();
+  }
+
+  int read() override {
+    return m_port.read();
+  }
+
+  int peek() override {
+    return m_port.peek();
+  }
+
+private:
+  // waiting with interrupts turned off would wait for ever
+  bool can_wait() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    return SREG & (1 << SREG_I);
+#else
+    return true;
+#endif
+  }
+
+  // the rest of the line goes as well. The marker is sent before the next line
+  void drop(uint8_t c) {
+    if (m_dropped < 0xFFFF) {
+      m_dropped++;
+    }
+    if (c == '\n') {
+      m_dropping = false;
+      m_marker_due = true;
+    }
+  }
+
+  HardwareSerial &m_port;
+  RingBuffer<uint8_t, CONSOLE_TX_SIZE> m_ring;
+  uint16_t m_dropped = 0;
+  bool m_ring_on = false;
+  bool m_blocking = true;
+  bool m_dropping = false;
+  bool m_marker_due = false;
+};
@@ -24,8 +24,8 @@ ISR(TIMER2_COMPA_vect, ISR_NOBLOCK) {
 }
 #elif defined(ARDUINO_ARCH_MEGAAVR)
 ISR(TCB2_INT_vect, ISR_NOBLOCK){
+  TCB2.INTFLAGS = TCB_CAPT_bm; // manually clear the interrupt before an overrun can set it again
   systick.update();
-  TCB2.INTFLAGS = TCB_CAPT_bm; // manually clear the interrupt
 }
 #else
 #warning you will need a systick interrupt running at 500Hz
@@ -19,9 +19,126 @@
 
 #include "../config.h"
 #include "adc.h"
+#include "atomic.h"
 #include "motors.h"
+#include "profiler.h"
+#include "recorder.h"
 #include "sensors.h"
+#include "serial.h"
 #include "switches.h"
+#include "telemetry.h"
+
+/***
+ * The timer settings all come from SYSTICK_HZ in config.h.
+ *
+ * On the ATmega328, Timer 2 always counts 250 times per tick. The prescaler
+ * is 128, 64 or 32 for 500Hz, 1kHz or 2kHz so it counts in 8us, 4us or 2us.
+ *
+ * On the ATmega4809, TCB2 shares the TCA clock of F_CPU/64 and counts in 4us.
+ * The top count gets smaller as the rate goes up.
+ *
+ * The systick timer count is also used to time the ISR. The count starts from
+ * zero at each tick so the count on entry to the ISR is how late it started
+ * and the count on exit is how long it took to get there.
+ */
+#if defined(ARDUINO_ARCH_AVR)
+const uint16_t SYSTICK_TIMER_TOP = 249;
+const uint16_t SYSTICK_PRESCALER = F_CPU / ((SYSTICK_TIMER_TOP + 1UL) * SYSTICK_HZ);
+const uint8_t SYSTICK_US_PER_COUNT = SYSTICK_PRESCALER / (F_CPU / 1000000UL);
+#elif defined(ARDUINO_ARCH_MEGAAVR)
+const uint16_t SYSTICK_TIMER_TOP = F_CPU / 64 / SYSTICK_HZ - 1;
+const uint8_t SYSTICK_US_PER_COUNT = 64 / (F_CPU / 1000000UL);
+#else
+const uint16_t SYSTICK_TIMER_TOP = 0;
+const uint8_t SYSTICK_US_PER_COUNT = 1;
+#endif
+
+/***
+ * The systick tasks run on a fixed schedule. Each task runs every so many
+ * ticks, set in config.h, starting at the tick given by its phase here.
+ *
+ * The control and sensor tasks normally run on every tick. The slower tasks
+ * are staggered so that no two of them share a tick and add to the worst
+ * case ISR time. Two tasks can only avoid each other if their phases differ
+ * modulo the greatest common divisor of their tick counts. Thus, tasks every
+ * 10 and 20 ticks need phases that differ modulo 10. The compiler checks. If
+ * you change the tick counts in config.h you may need to change the phases
+ * as well. At 2kHz, the sensors run on even ticks so the slower tasks have
+ * odd phases to keep clear of them.
+ */
+const uint8_t CONTROL_PHASE = 0;
+const uint8_t SENSOR_PHASE = 0;
+const uint8_t BATTERY_PHASE = 1;
+const uint8_t SWITCH_PHASE = 7;
+
+constexpr uint8_t ticks_gcd(uint8_t a, uint8_t b) {
+  return b == 0 ? a : ticks_gcd(b, a % b);
+}
+
+// tasks that run every tick cannot be staggered so they are not checked
+constexpr bool tasks_staggered(uint8_t ticks_a, uint8_t phase_a, uint8_t ticks_b, uint8_t phase_b) {
+  return ticks_a == 1 || ticks_b == 1 || phase_a % ticks_gcd(ticks_a, ticks_b) != phase_b % ticks_gcd(ticks_a, ticks_b);
+}
+
+static_assert(CONTROL_TICKS > 0 && SENSOR_TICKS > 0 && BATTERY_TICKS > 0 && SWITCH_TICKS > 0, "task ticks must be at least 1");
+static_assert(CONTROL_PHASE < CONTROL_TICKS && SENSOR_PHASE < SENSOR_TICKS, "task phase must be less than its ticks");
+static_assert(BATTERY_PHASE < BATTERY_TICKS && SWITCH_PHASE < SWITCH_TICKS, "task phase must be less than its ticks");
+static_assert(tasks_staggered(CONTROL_TICKS, CONTROL_PHASE, SENSOR_TICKS, SENSOR_PHASE), "control and sensor tasks share a tick");
+static_assert(tasks_staggered(CONTROL_TICKS, CONTROL_PHASE, BATTERY_TICKS, BATTERY_PHASE), "control and battery tasks share a tick");
+static_assert(tasks_staggered(CONTROL_TICKS, CONTROL_PHASE, SWITCH_TICKS, SWITCH_PHASE), "control and switch tasks share a tick");
+static_assert(tasks_staggered(SENSOR_TICKS, SENSOR_PHASE, BATTERY_TICKS, BATTERY_PHASE), "sensor and battery tasks share a tick");
+static_assert(tasks_staggered(SENSOR_TICKS, SENSOR_PHASE, SWITCH_TICKS, SWITCH_PHASE), "sensor and switch tasks share a tick");
+static_assert(tasks_staggered(BATTERY_TICKS, BATTERY_PHASE, SWITCH_TICKS, SWITCH_PHASE), "battery and switch tasks share a tick");
+
+/***
+ * Timing figures for the systick ISR gathered since they were last read.
+ * All the times are in timer counts. Multiply by SYSTICK_US_PER_COUNT to
+ * get microseconds.
+ *
+ *   latency   - from the timer tick to the start of the ISR
+ *   busy      - from the start of the ISR to the end. Use this for the load.
+ *               It leaves out the time the ISR was kept waiting by other
+ *               interrupts or by an ATOMIC_BLOCK in the main code
+ *   duration  - from the timer tick to the end of the ISR. The sensor cycle
+ *               has to fit in what is left of the period after that
+ *   jitter    - the largest change in latency from one tick to the next.
+ *               That is how far a period was from nominal.
+ *   late      - ticks with latency over SYSTICK_LATE_US
+ *   overruns  - ticks still running when the next one was due
+ *   loops     - passes through the main loop
+ */
+struct SystickTiming {
+  uint32_t ticks;
+  uint16_t latency_min;
+  uint16_t latency_max;
+  uint16_t busy_min;
+  uint16_t busy_max;
+  uint32_t busy_sum;
+  uint16_t duration_max;
+  uint16_t jitter_max;
+  uint16_t late;
+  uint16_t overruns;
+  uint32_t loops;
+};
+
+/***
+ * A copy of the control state made by systick at the end of each control
+ * tick. Everything in it comes from the same tick. See read_snapshot().
+ */
+struct ControlSnapshot {
+  uint32_t ticks; // control ticks since reset
+  float robot_distance;
+  float robot_angle;
+  float fwd_position;
+  float fwd_speed;
+  float rot_position;
+  float rot_speed;
+  int fwd_millivolts;
+  int rot_millivolts;
+  int cross_track_error;
+  float steering_feedback;
+};
+
 class Systick {
 public:
   // don't let this start firing up before we are ready.
@@ -31,26 +148,27 @@ public:
     bitClear(TCCR2A, WGM20);
     bitSet(TCCR2A, WGM21);
     bitClear(TCCR2B, WGM22);
-    // set divisor to 128 => 125kHz
-    bitSet(TCCR2B, CS22);
-    bitClear(TCCR2B, CS21);
-    bitSet(TCCR2B, CS20);
-    OCR2A = 249; // (16000000/128/500)-1 => 500Hz
+    // set divisor to 32, 64 or 128 => 500kHz, 250kHz or 125kHz
+    bitWrite(TCCR2B, CS22, SYSTICK_PRESCALER != 32);
+    bitWrite(TCCR2B, CS21, SYSTICK_PRESCALER == 32);
+    bitWrite(TCCR2B, CS20, SYSTICK_PRESCALER != 64);
+    OCR2A = SYSTICK_TIMER_TOP; // (16000000/SYSTICK_PRESCALER/SYSTICK_HZ)-1
     bitSet(TIMSK2, OCIE2A);
 #elif defined(ARDUINO_ARCH_MEGAAVR)
     TCB2.CTRLA &= ~TCB_ENABLE_bm;      // stop the timer
     TCB2.CTRLA = TCB_CLKSEL_CLKTCA_gc; // Clock selection is same as TCA (F_CPU/64 -- 250kHz)
     TCB2.CTRLB = (TCB_CNTMODE_INT_gc); // set periodic interrupt Mode
     // timer is clocked at 250000Hz = 4us per tick
-    TCB2.CCMP = 2000 / (1000000 / 250000) - 1; // we want 2000us => 5000 ticks
+    TCB2.CCMP = SYSTICK_TIMER_TOP;             // tick period / 4us - 1
     TCB2.CTRLA |= TCB_ENABLE_bm;               // Enable & start
     TCB2.INTCTRL |= TCB_CAPT_bm;               // Enable timer interrupt
 #endif
     delay(10); // make sure it runs for a few cycles before we continue
+    read_timing();
   }
   /***
-   * This is the SYSTICK ISR. It runs at 500Hz by default and is
-   * called from the TIMER 2 interrupt (vector 7).
+   * This is the SYSTICK ISR. It runs at SYSTICK_HZ, 500Hz by default, and
+   * is called from the TIMER 2 interrupt (vector 7).
    *
    * All the time-critical control functions happen in here.
    *
@@ -60,8 +178,12 @@ public:
    * The last thing it does is to start the sensor reads so that they
    * will be ready to use next time around.
    *
-   * Timing tests indicate that, with the robot at rest, the systick ISR
-   * consumes about 10% of the available system bandwidth.
+   * Each task only runs when it is due. See the schedule above.
+   *
+   * Every tick is timed using the systick timer itself. The CLI 'I' command
+   * shows the figures. Earlier timing tests indicated that, with the robot
+   * at rest, the systick ISR consumes about 10% of the available system
+   * bandwidth.
    *
    * With just a single profile active and moving, that increases to nearly 30%.
    * Two such active profiles increases it to about 35-40%.
@@ -75,21 +197,349 @@ public:
    *
    */
   void update() {
+    uint16_t entry = timer_count();
+    PROFILE_SECTION(PROF_SYSTICK);
     // digitalWriteFast(LED_BUILTIN, 1);
     // NOTE - the code here seems to get inlined and so the function is 2800 bytes!
     // TODO: make sure all variables are interrupt-safe if they are used outside IRQs
-    // grab the encoder values first because they will continue to change
-    encoders.update();
-    forward.update();
-    rotation.update();
-    sensors.update();
-    switches.update();
-    motors.set_battery_compensation(sensors.get_battery_comp());
-    motors.update_controllers(sensors.get_steering_feedback());
-    adc.start_conversion_cycle();
-    // NOTE: no code should follow this line;
+    bool control = task_due(m_control_countdown, CONTROL_TICKS);
+    bool sensing = task_due(m_sensor_countdown, SENSOR_TICKS);
+    if (control) {
+      // grab the encoder values first because they will continue to change
+      encoders.update();
+      {
+        PROFILE_SECTION(PROF_FORWARD);
+        forward.update();
+      }
+      {
+        PROFILE_SECTION(PROF_ROTATION);
+        rotation.update();
+      }
+    }
+    if (sensing) {
+      sensors.update();
+    }
+    if (task_due(m_switch_countdown, SWITCH_TICKS)) {
+      switches.update();
+    }
+    if (task_due(m_battery_countdown, BATTERY_TICKS)) {
+      sensors.update_battery_voltage();
+      motors.set_battery_compensation(sensors.get_battery_comp());
+    }
+    if (control) {
+      motors.update_controllers(sensors.get_steering_feedback());
+      // the PWM has just been written with the results of the last sensor cycle
+      PROFILE_SAMPLE_USED(PROF_SAMPLE_TO_PWM);
+      supervise_acceleration();
+      publish_snapshot();
+#if TELEMETRY
+      if (telemetry.active()) {
+        capture_telemetry();
+      }
+#endif
+      if (recorder.recording()) {
+        record_flight();
+      }
+    }
+    console.pump(CONSOLE_TX_PER_TICK);
+    if (sensing) {
+      adc.start_conversion_cycle();
+    }
+    // NOTE: no code but the timing should follow this line;
     // digitalWriteFast(LED_BUILTIN, 0);
+    record_timing(entry);
+  }
+
+  /***
+   * The snapshot is protected by a sequence count rather than by turning
+   * off interrupts. The count is odd while the snapshot is being written.
+   * Only systick writes it so the main loop can never see it half done
+   * unless systick interrupts the copy. A reader that sees the count change
+   * just copies it again.
+   *
+   * The getters each turn interrupts off for a moment. That is harmless
+   * here and keeps the classes in charge of their own data.
+   */
+  void publish_snapshot() {
+    m_snapshot_sequence++;
+    memory_barrier();
+    ControlSnapshot &s = m_snapshot;
+    s.ticks++;
+    s.robot_distance = encoders.robot_distance();
+    s.robot_angle = encoders.robot_angle();
+    s.fwd_position = forward.position();
+    s.fwd_speed = forward.speed();
+    s.rot_position = rotation.position();
+    s.rot_speed = rotation.speed();
+    s.fwd_millivolts = motors.get_fwd_millivolts();
+    s.rot_millivolts = motors.get_rot_millivolts();
+    s.cross_track_error = sensors.get_cross_track_error();
+    s.steering_feedback = sensors.get_steering_feedback();
+    memory_barrier();
+    m_snapshot_sequence++;
+  }
+
+#if TELEMETRY
+  /***
+   * Only the channels that are due on this tick are worked out. Most of the
+   * values come from the snapshot that has just been published.
+   */
+  void capture_telemetry() {
+    if (not telemetry.begin_record(m_snapshot.ticks)) {
+      return;
+    }
+    for (uint8_t channel = 0; channel < TELEMETRY_CHANNELS; channel++) {
+      if (telemetry.wanted(channel)) {
+        telemetry.add_value(channel, telemetry_value(channel));
+      }
+    }
+    telemetry.end_record();
+  }
+
+  // the channels are listed in telemetry.h
+  long telemetry_value(uint8_t channel) {
+    const ControlSnapshot &s = m_snapshot;
+    switch (channel) {
+      case TEL_ROBOT_DISTANCE:
+        return telemetry_scaled(s.robot_distance, channel);
+      case TEL_ROBOT_ANGLE:
+        return telemetry_scaled(s.robot_angle, channel);
+      case TEL_FWD_POSITION:
+        return telemetry_scaled(s.fwd_position, channel);
+      case TEL_FWD_SPEED:
+        return telemetry_scaled(s.fwd_speed, channel);
+      case TEL_ROT_POSITION:
+        return telemetry_scaled(s.rot_position, channel);
+      case TEL_ROT_SPEED:
+        return telemetry_scaled(s.rot_speed, channel);
+      case TEL_FWD_ERROR:
+        return telemetry_scaled(motors.get_fwd_error(), channel);
+      case TEL_ROT_ERROR:
+        return telemetry_scaled(motors.get_rot_error(), channel);
+      case TEL_FWD_MILLIVOLTS:
+        return s.fwd_millivolts;
+      case TEL_ROT_MILLIVOLTS:
+        return s.rot_millivolts;
+      case TEL_LFS:
+        return sensors.lfs.value;
+      case TEL_LSS:
+        return sensors.lss.value;
+      case TEL_RSS:
+        return sensors.rss.value;
+      case TEL_RFS:
+        return sensors.rfs.value;
+      case TEL_CROSS_TRACK_ERROR:
+        return s.cross_track_error;
+      case TEL_STEERING:
+        return telemetry_scaled(s.steering_feedback, channel);
+      case TEL_BATTERY:
+        return telemetry_scaled(sensors.battery_voltage(), channel);
+      default:
+        return 0;
+    }
+  }
+#endif
+
+  /***
+   * Fill in the next flight recorder sample from the snapshot. A crash
+   * freezes the recorder straight after the sample that shows it.
+   */
+  void record_flight() {
+    float fwd_error = motors.get_fwd_error();
+    float rot_error = motors.get_rot_error();
+    if (recorder.sample_due()) {
+      const ControlSnapshot &s = m_snapshot;
+      FlightSample &f = recorder.next_sample();
+      f.tick = s.ticks;
+      f.fwd_speed = saturate_int16(lroundf(s.fwd_speed));
+      f.rot_speed = saturate_int16(lroundf(s.rot_speed));
+      f.fwd_error = saturate_int16(lroundf(fwd_error * 100));
+      f.rot_error = saturate_int16(lroundf(rot_error * 100));
+      f.fwd_millivolts = s.fwd_millivolts;
+      f.rot_millivolts = s.rot_millivolts;
+      f.cross_track_error = constrain(s.cross_track_error, -127, 127);
+      recorder.commit_sample(trigger_fired(f));
+    }
+    if (fabsf(fwd_error) > CRASH_FWD_ERROR || fabsf(rot_error) > CRASH_ROT_ERROR) {
+      recorder.freeze(FREEZE_CRASH);
+    }
+  }
+
+  // event triggers are left to the recorder
+  bool trigger_fired(const FlightSample &f) {
+    int level = recorder.trigger_level();
+    switch (recorder.trigger_source()) {
+      case TRIGGER_LFS:
+        return sensors.lfs.value >= level;
+      case TRIGGER_LSS:
+        return sensors.lss.value >= level;
+      case TRIGGER_RSS:
+        return sensors.rss.value >= level;
+      case TRIGGER_RFS:
+        return sensors.rfs.value >= level;
+      case TRIGGER_FWD_ERROR:
+        return abs(f.fwd_error) >= level;
+      case TRIGGER_ROT_ERROR:
+        return abs(f.rot_error) >= level;
+      default:
+        return false;
+    }
+  }
+
+  static int16_t saturate_int16(long value) {
+    return (int16_t)constrain(value, -32767L, 32767L);
+  }
+
+  /***
+   * Get a consistent copy of the control state without blocking interrupts.
+   * Use this in the main loop when several values are needed together.
+   * Copying takes a few microseconds so a retry is rare. Do not call it
+   * from an interrupt.
+   */
+  ControlSnapshot read_snapshot() {
+    ControlSnapshot copy;
+    uint8_t sequence;
+    do {
+      sequence = m_snapshot_sequence;
+      memory_barrier();
+      copy = m_snapshot;
+      memory_barrier();
+    } while ((sequence & 1) || sequence != m_snapshot_sequence);
+    return copy;
+  }
+
+  /***
+   * A task is due when its countdown reaches zero. The countdown then
+   * starts again from the task interval. Counting down avoids a division.
+   */
+  bool task_due(uint8_t &countdown, uint8_t ticks) {
+    if (countdown > 0) {
+      countdown--;
+      return false;
+    }
+    countdown = ticks - 1;
+    return true;
+  }
+
+  /***
+   * Called at the very end of the ISR. If the timer has already flagged the
+   * next tick, or the count has wrapped, the ISR ran into the next period.
+   * The duration is then only a lower bound. A wrapped count is put back
+   * on top of the period so that both the duration and the busy time come
+   * out right.
+   */
+  void record_timing(uint16_t entry) {
+    uint16_t exit = timer_count();
+    bool overrun = next_tick_pending() || exit < entry;
+    uint16_t duration = overrun && exit < entry ? exit + SYSTICK_TIMER_TOP + 1 : exit;
+    uint16_t busy = duration - entry;
+    SystickTiming &t = m_timing;
+    t.ticks++;
+    t.busy_sum += busy;
+    t.busy_min = min(t.busy_min, busy);
+    t.busy_max = max(t.busy_max, busy);
+    t.duration_max = max(t.duration_max, duration);
+    t.latency_min = min(t.latency_min, entry);
+    t.latency_max = max(t.latency_max, entry);
+    uint16_t jitter = entry > m_last_entry ? entry - m_last_entry : m_last_entry - entry;
+    t.jitter_max = max(t.jitter_max, jitter);
+    m_last_entry = entry;
+    if (entry > SYSTICK_LATE_US / SYSTICK_US_PER_COUNT) {
+      t.late++;
+    }
+    if (overrun) {
+      t.overruns++;
+    }
+  }
+
+  // the main loop calls this on every pass to measure how often it runs
+  void count_loop_pass() {
+    m_loops++;
+  }
+
+  /***
+   * Get the timing figures gathered since the last call and start again.
+   */
+  SystickTiming read_timing() {
+    SystickTiming timing;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      timing = m_timing;
+      m_timing = {0, 0xFFFF, 0, 0xFFFF, 0, 0, 0, 0, 0, 0, 0};
+    }
+    timing.loops = m_loops;
+    m_loops = 0;
+    return timing;
+  }
+
+  uint16_t timer_count() {
+#if defined(ARDUINO_ARCH_AVR)
+    return TCNT2;
+#elif defined(ARDUINO_ARCH_MEGAAVR)
+    return TCB2.CNT;
+#else
+    return 0;
+#endif
+  }
+
+  bool next_tick_pending() {
+#if defined(ARDUINO_ARCH_AVR)
+    return bitRead(TIFR2, OCF2A);
+#elif defined(ARDUINO_ARCH_MEGAAVR)
+    return TCB2.INTFLAGS & TCB_CAPT_bm;
+#else
+    return false;
+#endif
   }
+
+  /***
+   * The acceleration supervisor watches for signs that the robot cannot
+   * follow its profiles. Wheel slip on a fast start or turn lets the
+   * controller error grow. When the battery sags, or the demand is just
+   * too high, the motor voltage reaches its limit. Either way, asking for
+   * more acceleration only makes it worse.
+   *
+   * Slip in the forward or rotation controller reduces the acceleration
+   * of that profile. Voltage saturation affects both wheels and so reduces
+   * both. Once the problem goes away, the acceleration slowly recovers.
+   *
+   * Runs in the systick after the controllers have been updated.
+   */
+  void supervise_acceleration() {
+    float available = min(MAX_MOTOR_VOLTS, sensors.battery_voltage()) * SATURATION_MARGIN;
+    float left = fabsf(motors.get_left_motor_volts());
+    float right = fabsf(motors.get_right_motor_volts());
+    bool saturated = left >= available || right >= available;
+    bool fwd_slip = fabsf(motors.get_fwd_error()) > SLIP_FWD_ERROR;
+    bool rot_slip = fabsf(motors.get_rot_error()) > SLIP_ROT_ERROR;
+    forward.set_acceleration_scale(next_acceleration_scale(forward.acceleration_scale(), fwd_slip || saturated));
+    rotation.set_acceleration_scale(next_acceleration_scale(rotation.acceleration_scale(), rot_slip || saturated));
+  }
+
+  float next_acceleration_scale(float scale, bool limited) {
+    if (limited) {
+      scale *= LOOP_ACC_SCALE_DECAY;
+      if (scale < ACC_SCALE_MIN) {
+        scale = ACC_SCALE_MIN;
+      }
+    } else if (scale < 1.0f) {
+      scale += ACC_SCALE_RECOVERY * LOOP_INTERVAL;
+      if (scale > 1.0f) {
+        scale = 1.0f;
+      }
+    }
+    return scale;
+  }
+
+private:
+  SystickTiming m_timing = {0, 0xFFFF, 0, 0xFFFF, 0, 0, 0, 0, 0, 0, 0};
+  uint16_t m_last_entry = 0;
+  uint32_t m_loops = 0;
+  uint8_t m_control_countdown = CONTROL_PHASE;
+  uint8_t m_sensor_countdown = SENSOR_PHASE;
+  uint8_t m_battery_countdown = BATTERY_PHASE;
+  uint8_t m_switch_countdown = SWITCH_PHASE;
+  ControlSnapshot m_snapshot = {0};
+  volatile uint8_t m_snapshot_sequence = 0;
 };
 
 extern Systick systick;
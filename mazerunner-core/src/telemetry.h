@@ -0,0 +1,450 @@
+/******************************************************************************
+ * Project: mazerunner-core                                                   *
+ * File:    telemetry.h                                                       *
+ * File Created: Saturday, 17th October 2026 10:12:40 am                      *
+ * Author: Peter Harrison                                                     *
+ * -----                                                                      *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
+ * -----                                                                      *
+ * Copyright 2022 - 2026 Peter Harrison, Micromouseonline                     *
+ * -----                                                                      *
+ * Licence:                                                                   *
+ *     Use of this source code is governed by an MIT-style                    *
+ *     license that can be found in the LICENSE file or at                    *
+ *     https://opensource.org/licenses/MIT.                                   *
+ ******************************************************************************/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "../config.h"
+#include "ring_buffer.h"
+#include "serial.h"
+#include <Arduino.h>
+
+/***
+ * Binary telemetry sends records of the control state as often as every
+ * control tick. An ASCII report line takes about 60 characters. A binary
+ * record usually takes under 20 bytes so, even at 115200 baud, every tick
+ * can be sent.
+ *
+ * The channels that can be sent are listed in the registry below. Each one
+ * can be subscribed with its own decimation. A decimation of 1 sends the
+ * channel on every control tick, 5 on every fifth tick and so on. Zero turns
+ * it off. Use the CLI TEL command to choose, so that the link only carries
+ * the signals that matter at the time.
+ *
+ * Systick encodes each record straight into a ring buffer. The main loop
+ * sends whatever the serial port will take without waiting. If the ring
+ * fills up, records are dropped and counted rather than holding anything
+ * up.
+ *
+ * Every frame looks like this:
+ *
+ *   0xA5 0x5A type length payload[length] crc_lo crc_hi
+ *
+ * The two sync bytes let the receiver find the start of a frame. The CRC is
+ * CRC-16/CCITT (poly 0x1021, start 0xFFFF) over the type, length and
+ * payload. A frame with a bad CRC should be thrown away and the receiver
+ * should look for the next sync bytes.
+ *
+ * Frame types:
+ *
+ *   DESCRIPTOR - sent once when the stream starts. It holds the format
+ *                version and the number of channels in the registry. Then,
+ *                for each channel, the scale as a varint, the decimation as
+ *                a byte and the channel name with a zero on the end. Divide
+ *                a value by its scale to get the real units.
+ *   KEY        - the systick tick count as 4 bytes, low byte first, then
+ *                the channel mask and the values.
+ *   DELTA      - the number of ticks since the last record, then the channel
+ *                mask and the change in each value since it was last sent.
+ *
+ * The channel mask has one bit for each registry channel, channel 0 in bit 0
+ * of the first byte. The values follow in channel order for just those
+ * channels that have their bit set.
+ *
+ * Numbers in KEY and DELTA records are zigzag encoded varints. Small values,
+ * positive or negative, take a single byte. Most of the changes from one
+ * tick to the next are small.
+ *
+ * A delta only makes sense if the receiver has the value before it. A KEY
+ * record holds every subscribed channel. It is sent every
+ * TELEMETRY_KEY_INTERVAL records and always after a record has been
+ * dropped. The receiver can then start or recover part way through the
+ * stream.
+ */
+
+enum {
+  TELEMETRY_DESCRIPTOR = 1,
+  TELEMETRY_KEY = 2,
+  TELEMETRY_DELTA = 3,
+};
+
+const uint8_t TELEMETRY_VERSION = 2;
+const uint8_t TELEMETRY_SYNC_1 = 0xA5;
+const uint8_t TELEMETRY_SYNC_2 = 0x5A;
+
+/***
+ * The channel registry. Systick supplies the values. See
+ * Systick::telemetry_value(). New channels go on the end so that old logs
+ * can still be read. There can be up to 24 of them.
+ */
+enum {
+  TEL_ROBOT_DISTANCE,
+  TEL_ROBOT_ANGLE,
+  TEL_FWD_POSITION,
+  TEL_FWD_SPEED,
+  TEL_ROT_POSITION,
+  TEL_ROT_SPEED,
+  TEL_FWD_ERROR,
+  TEL_ROT_ERROR,
+  TEL_FWD_MILLIVOLTS,
+  TEL_ROT_MILLIVOLTS,
+  TEL_LFS,
+  TEL_LSS,
+  TEL_RSS,
+  TEL_RFS,
+  TEL_CROSS_TRACK_ERROR,
+  TEL_STEERING,
+  TEL_BATTERY,
+  TELEMETRY_CHANNELS,
+};
+
+const uint8_t TELEMETRY_MASK_BYTES = (TELEMETRY_CHANNELS + 7) / 8;
+static_assert(TELEMETRY_MASK_BYTES <= 3, "too many telemetry channels");
+
+// the names are only needed for the descriptor and the CLI so they stay in flash
+const char TELEMETRY_NAMES[] PROGMEM = "distance\0angle\0fwd_pos\0fwd_speed\0rot_pos\0rot_speed\0"
+                                       "fwd_error\0rot_error\0fwd_mv\0rot_mv\0"
+                                       "lfs\0lss\0rss\0rfs\0cte\0steering\0battery";
+
+// the descriptor payload has to fit in its single length byte
+static_assert(2 + 3 * TELEMETRY_CHANNELS + sizeof(TELEMETRY_NAMES) <= 255, "the telemetry descriptor is too long");
+
+/***
+ * Each channel value is the real value multiplied by its scale and rounded
+ * to the nearest integer.
+ */
+const int TELEMETRY_SCALE[TELEMETRY_CHANNELS] PROGMEM = {
+    10, 10, 10, 1, 10, 1, 100, 100, 1, 1, 1, 1, 1, 1, 1, 10000, 1000,
+};
+
+/***
+ * The same columns as the old profile report. They are sent on every tick
+ * at a 500Hz control rate. That is about all that 115200 baud will carry.
+ * At faster control rates the defaults are multiplied by
+ * TELEMETRY_DECIMATION_SCALE so the stream stays at about the same data
+ * rate.
+ */
+const uint8_t TELEMETRY_DEFAULT_DECIMATION[TELEMETRY_CHANNELS] PROGMEM = {
+    1, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 0, 0, 0, 1, 1, 0,
+};
+const uint8_t TELEMETRY_DECIMATION_SCALE = (SYSTICK_HZ / CONTROL_TICKS + 499) / 500;
+
+// a KEY record is sent at least this often
+const uint8_t TELEMETRY_KEY_INTERVAL = 50;
+
+/***
+ * Records that will not fit in the frame buffer are dropped. Typical values
+ * take two or three bytes each so this is enough for about 16 channels.
+ */
+const uint8_t TELEMETRY_MAX_FRAME = 64;
+
+inline long telemetry_scaled(float value, uint8_t channel) {
+  return lroundf(value * (int)pgm_read_word(&TELEMETRY_SCALE[channel]));
+}
+
+class Telemetry {
+public:
+  Telemetry() {
+    set_defaults();
+  }
+
+  /***
+   * Sends the descriptor and then starts the records. Called from the main
+   * loop so the descriptor can be written directly. The ring is not in use
+   * until m_active is set.
+   */
+  void start() {
+    m_active = false;
+    m_ring.flush();
+    send_descriptor();
+    for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+      m_countdown[i] = 0;
+    }
+    m_records = 0;
+    m_need_key = true;
+    m_active = true;
+  }
+
+  // stop recording and wait for the last of the records to go out
+  void stop() {
+    m_active = false;
+    while (not m_ring.empty()) {
+      send();
+    }
+    console.flush();
+  }
+
+  bool active() {
+    return m_active;
+  }
+
+  uint16_t dropped() {
+    return m_ring.dropped() + m_too_long;
+  }
+
+  //***************************************************************************//
+  // The subscriptions. Change them only when the stream is not running.
+
+  void set_defaults() {
+    for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+      m_decimation[i] = pgm_read_byte(&TELEMETRY_DEFAULT_DECIMATION[i]) * TELEMETRY_DECIMATION_SCALE;
+    }
+  }
+
+  void subscribe(uint8_t channel, uint8_t decimation) {
+    if (channel < TELEMETRY_CHANNELS) {
+      m_decimation[channel] = decimation;
+    }
+  }
+
+  void unsubscribe_all() {
+    for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+      m_decimation[i] = 0;
+    }
+  }
+
+  // the channel number for a name or -1 if there is no such channel
+  int find_channel(const char *name) {
+    const char *p = TELEMETRY_NAMES;
+    for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+      if (strcmp_P(name, p) == 0) {
+        return i;
+      }
+      p += strlen_P(p) + 1;
+    }
+    return -1;
+  }
+
+  void print_channels() {
+    const char *p = TELEMETRY_NAMES;
+    for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+      console.print((const __FlashStringHelper *)p);
+      for (int n = strlen_P(p); n < 12; n++) {
+        console.print(' ');
+      }
+      if (m_decimation[i] == 0) {
+        console.println('-');
+      } else {
+        console.print('/');
+        console.println(m_decimation[i]);
+      }
+      p += strlen_P(p) + 1;
+    }
+  }
+
+  //***************************************************************************//
+
+  /***
+   * Called from the main loop, as often as possible, to move the records to
+   * the serial port. It only writes what will fit in the serial buffer so it
+   * never has to wait.
+   */
+  void send() {
+    uint8_t buffer[16];
+    int room = console.availableForWrite();
+    while (room > 0) {
+      uint8_t count = m_ring.pop(buffer, min(room, (int)sizeof(buffer)));
+      if (count == 0) {
+        break;
+      }
+      console.write_raw(buffer, count);
+      room -= count;
+    }
+  }
+
+  /***
+   * Systick builds a record in three steps:
+   *
+   *   if (telemetry.begin_record(tick)) {
+   *     for each channel
+   *       if (telemetry.wanted(channel))
+   *         telemetry.add_value(channel, value);
+   *     telemetry.end_record();
+   *   }
+   *
+   * begin_record() works out which channels are due on this tick and
+   * returns false if there are none. Only the KEY records carry the whole
+   * tick count. The others just say how many ticks have gone by since the
+   * record before.
+   */
+  bool begin_record(uint32_t tick) {
+    if (not m_active) {
+      return false;
+    }
+    m_key = m_need_key || m_records == 0;
+    bool any = false;
+    for (int i = 0; i < TELEMETRY_MASK_BYTES; i++) {
+      m_mask[i] = 0;
+    }
+    for (uint8_t i = 0; i < TELEMETRY_CHANNELS; i++) {
+      if (m_decimation[i] == 0) {
+        continue;
+      }
+      bool due = m_countdown[i] == 0;
+      if (due) {
+        m_countdown[i] = m_decimation[i] - 1;
+      } else {
+        m_countdown[i]--;
+      }
+      if (due || m_key) {
+        m_mask[i >> 3] |= 1 << (i & 7);
+        any = true;
+      }
+    }
+    if (not any) {
+      return false;
+    }
+    begin_frame(m_key ? TELEMETRY_KEY : TELEMETRY_DELTA);
+    if (m_key) {
+      for (int i = 0; i < 4; i++) {
+        put_byte(tick >> (8 * i));
+      }
+    } else {
+      put_varint(tick - m_last_tick);
+    }
+    m_last_tick = tick;
+    for (int i = 0; i < TELEMETRY_MASK_BYTES; i++) {
+      put_byte(m_mask[i]);
+    }
+    return true;
+  }
+
+  bool wanted(uint8_t channel) {
+    return m_mask[channel >> 3] & (1 << (channel & 7));
+  }
+
+  void add_value(uint8_t channel, long value) {
+    put_signed(m_key ? value : value - m_last_value[channel]);
+    m_last_value[channel] = value;
+  }
+
+  void end_record() {
+    bool sent = false;
+    if (m_length <= TELEMETRY_MAX_FRAME - 2) {
+      end_frame();
+      sent = m_ring.push(m_frame, m_length);
+    } else if (m_too_long < 0xFFFF) {
+      m_too_long++;
+    }
+    // a delta is no use without the value before it
+    m_need_key = not sent;
+    if (++m_records >= TELEMETRY_KEY_INTERVAL) {
+      m_records = 0;
+    }
+  }
+
+private:
+  /***
+   * The descriptor is too big for the frame buffer so it is written straight
+   * out, working out the CRC as it goes. The scales all fit in a two byte
+   * varint.
+   */
+  void send_descriptor() {
+    uint8_t length = 2 + 3 * TELEMETRY_CHANNELS + sizeof(TELEMETRY_NAMES);
+    console.write_raw(TELEMETRY_SYNC_1);
+    console.write_raw(TELEMETRY_SYNC_2);
+    uint16_t crc = 0xFFFF;
+    crc = write_with_crc(TELEMETRY_DESCRIPTOR, crc);
+    crc = write_with_crc(length, crc);
+    crc = write_with_crc(TELEMETRY_VERSION, crc);
+    crc = write_with_crc(TELEMETRY_CHANNELS, crc);
+    const char *name = TELEMETRY_NAMES;
+    for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+      int scale = pgm_read_word(&TELEMETRY_SCALE[i]);
+      crc = write_with_crc((scale & 0x7F) | 0x80, crc);
+      crc = write_with_crc(scale >> 7, crc);
+      crc = write_with_crc(m_decimation[i], crc);
+      uint8_t c;
+      do {
+        c = pgm_read_byte(name++);
+        crc = write_with_crc(c, crc);
+      } while (c != 0);
+    }
+    console.write_raw(crc & 0xFF);
+    console.write_raw(crc >> 8);
+  }
+
+  uint16_t write_with_crc(uint8_t b, uint16_t crc) {
+    console.write_raw(b);
+    return crc_ccitt_update(crc, b);
+  }
+
+  void begin_frame(uint8_t type) {
+    m_frame[0] = TELEMETRY_SYNC_1;
+    m_frame[1] = TELEMETRY_SYNC_2;
+    m_frame[2] = type;
+    m_length = 4;
+  }
+
+  void end_frame() {
+    m_frame[3] = m_length - 4;
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 2; i < m_length; i++) {
+      crc = crc_ccitt_update(crc, m_frame[i]);
+    }
+    m_frame[m_length++] = crc & 0xFF;
+    m_frame[m_length++] = crc >> 8;
+  }
+
+  static uint16_t crc_ccitt_update(uint16_t crc, uint8_t data) {
+    crc ^= (uint16_t)data << 8;
+    for (int i = 0; i < 8; i++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+  }
+
+  // the length keeps counting past the end so end_record() can tell
+  void put_byte(uint8_t b) {
+    if (m_length < TELEMETRY_MAX_FRAME - 2) {
+      m_frame[m_length] = b;
+    }
+    if (m_length < 255) {
+      m_length++;
+    }
+  }
+
+  void put_varint(uint32_t value) {
+    while (value >= 0x80) {
+      put_byte((value & 0x7F) | 0x80);
+      value >>= 7;
+    }
+    put_byte(value);
+  }
+
+  // zigzag encoding maps 0, -1, 1, -2, 2 ... to 0, 1, 2, 3, 4 ...
+  void put_signed(long value) {
+    put_varint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+  }
+
+  RingBuffer<uint8_t, 128> m_ring;
+  uint8_t m_frame[TELEMETRY_MAX_FRAME];
+  uint8_t m_length = 0;
+  uint8_t m_decimation[TELEMETRY_CHANNELS];
+  uint8_t m_countdown[TELEMETRY_CHANNELS];
+  uint8_t m_mask[TELEMETRY_MASK_BYTES];
+  long m_last_value[TELEMETRY_CHANNELS];
+  uint32_t m_last_tick = 0;
+  uint16_t m_too_long = 0;
+  uint8_t m_records = 0;
+  bool m_key = false;
+  bool m_need_key = true;
+  volatile bool m_active = false;
+};
+
+extern Telemetry telemetry;
+
+#endif
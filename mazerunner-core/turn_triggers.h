@@ -0,0 +1,171 @@
+/******************************************************************************
+ * Project: mazerunner-core                                                   *
+ * File:    turn_triggers.h                                                   *
+ * File Created: Saturday, 17th October 2026 10:12:40 am                      *
+ * Author: Peter Harrison                                                     *
+ * -----                                                                      *
+ * Last Modified: Saturday, 17th October 2026 10:12:40 am                     *
+ * -----                                                                      *
+ * Copyright 2022 - 2026 Peter Harrison, Micromouseonline                     *
+ * -----                                                                      *
+ * Licence:                                                                   *
+ *     Use of this source code is governed by an MIT-style                    *
+ *     license that can be found in the LICENSE file or at                    *
+ *     https://opensource.org/licenses/MIT.                                   *
+ ******************************************************************************/
+
+#ifndef TURN_TRIGGERS_H
+#define TURN_TRIGGERS_H
+
+#include "config.h"
+#include "src/serial.h"
+#include "src/utils.h"
+#include <Arduino.h>
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+#include <EEPROM.h>
+#endif
+
+/***
+ * A smooth search turn starts when the front sensor sum reaches the trigger
+ * value for that turn. If there is no wall ahead, or the sensors do not see
+ * it in time, the turn starts when the robot reaches the nominal turn point
+ * instead. The threshold needs to be a bit higher when there are walls to the
+ * side because they add to the front sensor readings.
+ *
+ * Rather than hand tune those adjustments, each smooth turn is recorded
+ * here. For a sensor triggered turn ('S') the record says how far from the
+ * nominal turn point it happened. Odometry errors average out over many
+ * turns so any consistent difference is down to the threshold. It is
+ * converted to sensor counts with TRIGGER_COUNTS_PER_MM.
+ * For a distance triggered turn ('D') with a wall ahead, the front sensor
+ * sum at the turn point is just what the threshold should have been.
+ *
+ * There is one adjustment for each turn type and each combination of side
+ * walls. Each record moves the matching adjustment part of the way towards
+ * the new estimate. Adjustments are held in 1/16 count units so that
+ * small corrections are not lost.
+ *
+ * The learned values are kept in EEPROM so the robot improves over runs.
+ */
+
+const uint8_t TRIGGER_TURN_TYPES = 4;
+const uint8_t TRIGGER_WALL_CASES = 4; // none, left, right, both
+const uint8_t TRIGGER_SIGNATURE = 0x5A;
+const int16_t TRIGGER_OFFSET_LIMIT = 50 * 16;
+
+struct TurnRecord {
+  uint8_t turn_id;
+  uint8_t walls;
+  char cause;         // 'S' for sensor, 'D' for distance
+  int8_t error;       // mm from the nominal turn point
+  int16_t front_sum;  // when the turn started
+};
+
+class TurnTriggers;
+extern TurnTriggers turn_triggers;
+
+class TurnTriggers {
+public:
+  static uint8_t wall_case(bool left_wall, bool right_wall) {
+    return (left_wall ? 1 : 0) + (right_wall ? 2 : 0);
+  }
+
+  void reset() {
+    for (int t = 0; t < TRIGGER_TURN_TYPES; t++) {
+      m_offset[t][0] = 0;
+      m_offset[t][1] = 16 * TRIGGER_LEFT_WALL_ADJUST;
+      m_offset[t][2] = 16 * TRIGGER_RIGHT_WALL_ADJUST;
+      m_offset[t][3] = 16 * (TRIGGER_LEFT_WALL_ADJUST + TRIGGER_RIGHT_WALL_ADJUST);
+    }
+  }
+
+  /***
+   * @brief get the learned offsets from EEPROM or use the defaults if there are none
+   */
+  void begin() {
+    reset();
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    if (EEPROM.read(EEPROM_TURN_TRIGGERS) == TRIGGER_SIGNATURE) {
+      EEPROM.get(EEPROM_TURN_TRIGGERS + 1, m_offset);
+    }
+#endif
+  }
+
+  /***
+   * EEPROM.put() only writes the bytes that have changed so it is safe to
+   * call this after every run.
+   */
+  void save() {
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
+    EEPROM.update(EEPROM_TURN_TRIGGERS, TRIGGER_SIGNATURE);
+    EEPROM.put(EEPROM_TURN_TRIGGERS + 1, m_offset);
+#endif
+  }
+
+  // the adjustment, in sensor counts, to add to the base trigger threshold
+  int offset(uint8_t turn_id, bool left_wall, bool right_wall) {
+    return (m_offset[turn_id][wall_case(left_wall, right_wall)] + 8) >> 4;
+  }
+
+  /***
+   * @brief record the way a turn was triggered and update the adjustments
+   * @param error is the position where the turn started less the nominal turn point
+   * @param front_sum is the sensor reading when the turn started
+   */
+  void record(uint8_t turn_id, bool left_wall, bool right_wall, bool front_wall, bool sensor_triggered,
+              float error, int front_sum, int base_trigger) {
+    uint8_t walls = wall_case(left_wall, right_wall);
+    m_last.turn_id = turn_id;
+    m_last.walls = walls;
+    m_last.cause = sensor_triggered ? 'S' : 'D';
+    m_last.error = (int8_t)constrain(error, -127.0f, 127.0f);
+    m_last.front_sum = front_sum;
+    if (not front_wall) {
+      // nothing can be learned if there was nothing to see
+      return;
+    }
+    int16_t &offset = m_offset[turn_id][walls];
+    int16_t estimate;
+    if (sensor_triggered) {
+      // early turns have a negative error and need a higher threshold
+      estimate = offset - (int16_t)(16 * TRIGGER_COUNTS_PER_MM * error);
+    } else {
+      estimate = 16 * (front_sum - base_trigger);
+    }
+    offset += (estimate - offset) / (1 << TRIGGER_LEARNING_SHIFT);
+    offset = constrain(offset, -TRIGGER_OFFSET_LIMIT, TRIGGER_OFFSET_LIMIT);
+    if (m_samples[turn_id][walls] < 255) {
+      m_samples[turn_id][walls]++;
+    }
+  }
+
+  void print() {
+    console.println(F("turn  none  left right  both"));
+    for (int t = 0; t < TRIGGER_TURN_TYPES; t++) {
+      print_justified(t, 4);
+      for (int w = 0; w < TRIGGER_WALL_CASES; w++) {
+        print_justified((m_offset[t][w] + 8) >> 4, 6);
+      }
+      console.print(F("   ("));
+      for (int w = 0; w < TRIGGER_WALL_CASES; w++) {
+        print_justified(m_samples[t][w], 4);
+      }
+      console.println(F(" samples)"));
+    }
+    console.print(F("last: "));
+    console.print(m_last.cause);
+    print_justified(m_last.turn_id, 2);
+    print_justified(m_last.walls, 2);
+    print_justified(m_last.error, 5);
+    console.print(F("mm"));
+    print_justified(m_last.front_sum, 5);
+    console.println();
+  }
+
+private:
+  int16_t m_offset[TRIGGER_TURN_TYPES][TRIGGER_WALL_CASES];
+  uint8_t m_samples[TRIGGER_TURN_TYPES][TRIGGER_WALL_CASES] = {{0}};
+  TurnRecord m_last = {0, 0, '-', 0, 0};
+};
+
+#endif